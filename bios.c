@@ -29,6 +29,8 @@
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
 
+	In deterministic simulation mode (see "Deterministic simulation"
+	below), there are no timers, signals or PIC thread.
  */
 
 
@@ -52,6 +54,13 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* Deterministic simulation */
+	int sim_state;              /* SIM_RUN, SIM_HALTED, SIM_BARRIER or SIM_DONE */
+	int sim_kick;               /* Set when restarted while halted */
+	TimerDuration sim_wake;     /* The halt deadline, or HALT_FOREVER */
+	TimerDuration sim_alarm;    /* The timer deadline, or 0 */
+	pthread_cond_t sim_cond;    /* Wait here for the virtual cpu */
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -115,6 +124,14 @@ static unsigned long PIC_loops;
 /* Physical cores (needed for some heuristics) */
 static unsigned int physical_cores;
 
+/* Non-zero in deterministic simulation mode */
+static int sim_mode = 0;
+
+/* Forward decl. of simulation helpers */
+static void sim_start(Core* core);
+static void sim_stop(Core* core);
+static void sim_barrier();
+
 
 /* Initialize static vars. This is called via pthread_once() */
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
@@ -191,15 +208,20 @@ static void* core_thread(void* _core)
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
 	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	// Could also be CLOCK_REALTIME
-	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
+	if(! sim_mode) {
+		core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
+		core->timer_sigevent.sigev_signo = SIGALRM;
+		core->timer_sigevent.sigev_value.sival_int = core->id;
+		// Could also be CLOCK_REALTIME
+		CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
+	}
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
+	/* In simulation, wait for the virtual cpu */
+	if(sim_mode) sim_start(core);
+
 	/* execute the boot code */
 	core->bootfunc();
 
@@ -208,15 +230,20 @@ static void* core_thread(void* _core)
 		core->intvec[i] = NULL;
 	}		
 
-	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	if(sim_mode) {
+		sim_barrier();
+		sim_stop(core);
+	} else {
+		/* Delete the core timer */
+		CHECK(timer_delete(core->timer_id));
 
-	pthread_barrier_wait(& core_barrier);
+		pthread_barrier_wait(& core_barrier);
 
-	/* Stop PIC daemon */
-	if(core->id==0) {
-		PIC_active = 0;
-		interrupt_pic_thread();
+		/* Stop PIC daemon */
+		if(core->id==0) {
+			PIC_active = 0;
+			interrupt_pic_thread();
+		}
 	}
 
 	/* sync with all cores */
@@ -280,6 +307,12 @@ static inline int intr_fetch_lowest(Core* core, Interrupt* intp)
  */
 static inline void interrupt_core(Core* core)
 {
+	/* In simulation, a halted core with a kick may get the cpu */
+	if(sim_mode) {
+		core->sim_kick = 1;
+		return;
+	}
+
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;	
@@ -485,7 +518,7 @@ static int io_device_read(io_device* this, char* ptr)
 
 	if(rc!=1 && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		if(! sim_mode) interrupt_pic_thread();
 	}
 	return rc==1;
 }
@@ -505,7 +538,7 @@ static int io_device_write(io_device* this, char value)
 
 	if(rc!=1 && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		if(! sim_mode) interrupt_pic_thread();
 	} 
 
 	return rc==1;
@@ -550,6 +583,308 @@ static int terminal_destroy(terminal* this)
 
 
 
+/*
+	Deterministic simulation.
+
+	In simulation mode, the cores are still pthreads, but only the core that
+	holds the (single) virtual cpu runs; the others wait on their condition
+	variable. The cpu changes hands only inside BIOS calls (the clocks,
+	enabling or checking interrupts, ICIs, serial I/O, halting and barriers).
+	At each such call, the holder advances the virtual clock by SIM_STEP and,
+	when its run of calls is over, passes the cpu to a runnable core chosen
+	by a pseudo-random generator, seeded from the configuration.
+
+	Timers and serial timeouts expire on the virtual clock. Interrupts are
+	not signals: the holder dispatches its pending interrupts at BIOS calls
+	made with interrupts enabled (as the signal handler would). When every
+	core is halted, the virtual clock jumps to the earliest deadline.
+
+	Thus, the same seed and program give the same interleaving and the same
+	clock values at every run, except for terminal input, which comes from
+	the host. Note that a core keeps the cpu while it makes no BIOS calls;
+	a loop that waits for another core without making any, never ends.
+ */
+
+enum { SIM_RUN, SIM_HALTED, SIM_BARRIER, SIM_DONE };
+
+/* Virtual time (usec) taken by a BIOS call */
+#define SIM_STEP 1
+
+/* The maximum number of BIOS calls in a run of a core */
+#define SIM_MAX_RUN 64
+
+/* Virtual time between polls of the terminals */
+#define SIM_SERIAL_POLL 1000
+
+/* The virtual clock at boot */
+#define SIM_EPOCH 1000000
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int sim_owner;                 /* The core holding the cpu, or -1 */
+static uint sim_run;                  /* The BIOS calls left in the run of the owner */
+static uint64_t sim_rng;              /* The state of the generator */
+static TimerDuration sim_clock;       /* The virtual clock */
+static TimerDuration sim_serial_next; /* When to poll the terminals next */
+static uint sim_barrier_count;        /* Cores waiting at the barrier */
+
+
+/* xorshift64* */
+static inline uint64_t sim_random()
+{
+	sim_rng ^= sim_rng >> 12;
+	sim_rng ^= sim_rng << 25;
+	sim_rng ^= sim_rng >> 27;
+	return sim_rng * 2685821657736338717ull;
+}
+
+
+/* Raise the interrupt of a terminal device, if it is ready or timed out */
+static void sim_serial_raise(io_device* dev)
+{
+	if((! dev->ready && io_device_ready(dev->fd, dev->iodir))
+		|| sim_clock - dev->last_int > SERIAL_TIMEOUT)
+	{
+		dev->ready = 1;
+		dev->last_int = sim_clock;
+		raise_interrupt((Core*) dev->int_core,
+			(dev->iodir==IODIR_RX) ? SERIAL_RX_READY : SERIAL_TX_READY);
+	}
+}
+
+
+/* Raise the interrupts due by the virtual clock. Must hold sim_mutex. */
+static void sim_raise_due()
+{
+	for(uint c=0; c<ncores; c++) {
+		Core* core = CORE+c;
+		if(core->sim_alarm != 0 && core->sim_alarm <= sim_clock) {
+			core->sim_alarm = 0;
+			raise_interrupt(core, ALARM);
+		}
+	}
+
+	if(nterm > 0 && sim_clock >= sim_serial_next) {
+		sim_serial_next = sim_clock + SIM_SERIAL_POLL;
+		for(uint i=0; i<nterm; i++) {
+			sim_serial_raise(& TERM[i].con);
+			sim_serial_raise(& TERM[i].kbd);
+		}
+	}
+}
+
+
+/* Return true if a core may get the cpu. Must hold sim_mutex. */
+static int sim_runnable(Core* core)
+{
+	switch(core->sim_state) {
+		case SIM_RUN: 
+			return 1;
+		case SIM_HALTED: 
+			return core->intr_pending || core->sim_kick || core->sim_wake <= sim_clock;
+		default:
+			return 0;
+	}
+}
+
+
+/* The earliest deadline of a halted core, or HALT_FOREVER. Must hold sim_mutex. */
+static TimerDuration sim_next_event()
+{
+	TimerDuration next = HALT_FOREVER;
+	for(uint c=0; c<ncores; c++) {
+		Core* core = CORE+c;
+		if(core->sim_state != SIM_HALTED) continue;
+		if(core->sim_wake < next) next = core->sim_wake;
+		if(core->sim_alarm != 0 && core->sim_alarm < next) next = core->sim_alarm;
+	}
+	if(nterm > 0 && sim_serial_next < next) 
+		next = sim_serial_next;
+	return next;
+}
+
+
+/* 
+	Give the cpu to a runnable core, chosen at random, for a run of random
+	length. Must hold sim_mutex.
+ */
+static void sim_schedule()
+{
+	while(1) {
+		uint runnable[MAX_CORES];
+		uint n = 0;
+		int alive = 0;
+		for(uint c=0; c<ncores; c++) {
+			if(CORE[c].sim_state != SIM_DONE) alive = 1;
+			if(sim_runnable(CORE+c)) runnable[n++] = c;
+		}
+
+		if(n > 0) {
+			sim_owner = runnable[sim_random() % n];
+			sim_run = 1 + sim_random() % SIM_MAX_RUN;
+			CHECKRC(pthread_cond_signal(& CORE[sim_owner].sim_cond));
+			return;
+		}
+
+		if(! alive) {
+			sim_owner = -1;
+			return;
+		}
+
+		/* Every core is halted (or at the barrier): jump to the next event */
+		TimerDuration next = sim_next_event();
+		if(next == HALT_FOREVER)
+			FATAL("Simulation: every core is halted forever");
+
+		/* Only a terminal may wake up a core: do not spin the host */
+		if(nterm > 0 && next == sim_serial_next)
+			usleep(SIM_SERIAL_POLL);
+
+		if(next > sim_clock) sim_clock = next;
+		sim_raise_due();
+	}
+}
+
+
+/* Pass the cpu on, and wait until it comes back. Must hold sim_mutex. */
+static void sim_pass(Core* core)
+{
+	sim_schedule();
+	while(sim_owner != (int) core->id)
+		CHECKRC(pthread_cond_wait(& core->sim_cond, & sim_mutex));
+}
+
+
+/*
+	Dispatch the pending interrupts of the current core, if interrupts are
+	enabled, as the SIGUSR1 handler would.
+ */
+static void sim_dispatch()
+{
+	sigset_t curss;
+	while(curr_core()->intr_pending) {
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+		if(sigismember(&curss, SIGUSR1)) return;   /* disabled */
+		/* We may be on another core when this returns */
+		dispatch_interrupts(curr_core());
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	}
+}
+
+
+/* A BIOS call: advance the clock, maybe pass the cpu on, and dispatch interrupts */
+static void sim_point()
+{
+	Core* core = curr_core();
+	CHECKRC(pthread_mutex_lock(& sim_mutex));
+	sim_clock += SIM_STEP;
+	sim_raise_due();
+	if(--sim_run == 0)
+		sim_pass(core);
+	CHECKRC(pthread_mutex_unlock(& sim_mutex));
+
+	sim_dispatch();
+}
+
+
+/* Halt the current core until an interrupt, a restart, or the deadline */
+static void sim_halt(TimerDuration deadline)
+{
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+
+	Core* core = curr_core();
+	uint32_t cmask = 1 << cpu_core_id;
+
+	CHECKRC(pthread_mutex_lock(& sim_mutex));
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	core->sim_state = SIM_HALTED;
+	core->sim_wake = deadline;
+	core->sim_kick = 0;
+
+	sim_pass(core);
+
+	core->sim_state = SIM_RUN;
+	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	CHECKRC(pthread_mutex_unlock(& sim_mutex));
+
+	if(core->intr_pending)
+		dispatch_interrupts(core);
+
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+}
+
+
+/* Wait until every core has called this */
+static void sim_barrier()
+{
+	Core* core = curr_core();
+	CHECKRC(pthread_mutex_lock(& sim_mutex));
+	if(++sim_barrier_count == ncores) {
+		sim_barrier_count = 0;
+		for(uint c=0; c<ncores; c++)
+			if(CORE[c].sim_state == SIM_BARRIER) CORE[c].sim_state = SIM_RUN;
+	} else
+		core->sim_state = SIM_BARRIER;
+	sim_pass(core);
+	CHECKRC(pthread_mutex_unlock(& sim_mutex));
+}
+
+
+/* Wait for the cpu, at boot */
+static void sim_start(Core* core)
+{
+	CHECKRC(pthread_mutex_lock(& sim_mutex));
+	while(sim_owner != (int) core->id)
+		CHECKRC(pthread_cond_wait(& core->sim_cond, & sim_mutex));
+	CHECKRC(pthread_mutex_unlock(& sim_mutex));
+}
+
+
+/* Give up the cpu for good, at shutdown */
+static void sim_stop(Core* core)
+{
+	CHECKRC(pthread_mutex_lock(& sim_mutex));
+	core->sim_state = SIM_DONE;
+	sim_schedule();
+	CHECKRC(pthread_mutex_unlock(& sim_mutex));
+}
+
+
+/* Prepare the simulation, before the cores are launched */
+static void sim_init(uint64_t seed)
+{
+	sim_mode = 1;
+	sim_rng = seed;
+	sim_clock = SIM_EPOCH;
+	sim_serial_next = sim_clock;
+	sim_barrier_count = 0;
+
+	/* Core 0 boots first */
+	sim_owner = 0;
+	sim_run = 1 + sim_random() % SIM_MAX_RUN;
+
+	for(uint c=0; c<ncores; c++) {
+		CORE[c].sim_state = SIM_RUN;
+		CORE[c].sim_kick = 0;
+		CORE[c].sim_wake = HALT_FOREVER;
+		CORE[c].sim_alarm = 0;
+		CHECKRC(pthread_cond_init(& CORE[c].sim_cond, NULL));
+	}
+
+	for(uint i=0; i<nterm; i++)
+		TERM[i].con.last_int = TERM[i].kbd.last_int = sim_clock;
+}
+
+
+static void sim_finalize()
+{
+	for(uint c=0; c<ncores; c++)
+		CHECKRC(pthread_cond_destroy(& CORE[c].sim_cond));
+	sim_mode = 0;
+}
+
+
+
+
 
 /*
 	The PIC daemon dispatches interrupts to core threads,
@@ -855,6 +1190,9 @@ void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint s
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
+
+	const char* seed = getenv("TINYOS_SIM_SEED");
+	vmc->sim_seed = (seed != NULL) ? strtoull(seed, NULL, 0) : 0;
 }
 
 
@@ -900,6 +1238,10 @@ void vm_run(vm_config* vmc)
 	/* Initialize the halted vector */
 	halt_vector = 0;
 
+	/* Set up the simulation, if asked */
+	if(vmc->sim_seed != 0)
+		sim_init(vmc->sim_seed);
+
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
 		/* Initialize Core */
@@ -931,7 +1273,13 @@ void vm_run(vm_config* vmc)
 	PIC_loops = 0;
 
 	/* Run the interrupt controller daemon on this thread */	
-	PIC_daemon();
+	if(! sim_mode)
+		PIC_daemon();
+	else {
+		/* There is no PIC, just sync with the cores at boot and shutdown */
+		pthread_barrier_wait(& system_barrier);
+		pthread_barrier_wait(& system_barrier);
+	}
 
 	/* Wait for core threads to finish */
 	for(uint c=0; c<ncores; c++) {
@@ -942,6 +1290,9 @@ void vm_run(vm_config* vmc)
 #endif
 	}
 
+	if(sim_mode)
+		sim_finalize();
+
 	/* Delete the Core table */
 	ncores = 0;
 
@@ -992,7 +1343,11 @@ uint cpu_cores()
 
 
 
-void cpu_core_halt()
+/*
+	Halt the current core until SIGUSR1 arrives, or the timeout (if not NULL)
+	expires.
+ */
+static void core_halt(const struct timespec* halt_time)
 {
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
@@ -1011,10 +1366,9 @@ void cpu_core_halt()
 #endif
 
 	siginfo_t info;
-	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
 
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+	/* Sleep until a signal arrives (or the timeout expires) */
+	int rc = sigtimedwait(&sigusr1_set, &info, halt_time);
 		
 
 	if(rc>0) {
@@ -1035,6 +1389,41 @@ void cpu_core_halt()
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 }
 
+
+void cpu_core_halt()
+{
+	if(sim_mode) {
+		sim_halt(sim_clock + 10000);
+		return;
+	}
+
+	/* Sleep for 10 msec */
+	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+	core_halt(&halt_time);
+}
+
+
+void cpu_core_halt_until(TimerDuration deadline)
+{
+	if(sim_mode) {
+		if(deadline == HALT_FOREVER || deadline > sim_clock)
+			sim_halt(deadline);
+		return;
+	}
+
+	if(deadline == HALT_FOREVER) {
+		core_halt(NULL);
+		return;
+	}
+
+	TimerDuration now = get_coarse_time();
+	if(deadline <= now) return;
+
+	TimerDuration delta = deadline - now;
+	struct timespec halt_time = {.tv_sec = delta / 1000000ul, .tv_nsec = (delta % 1000000ul)*1000ul};
+	core_halt(&halt_time);
+}
+
 static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
@@ -1079,13 +1468,17 @@ void cpu_core_restart_all()
 
 void cpu_core_barrier_sync()
 {
-	pthread_barrier_wait(& core_barrier);
+	if(sim_mode)
+		sim_barrier();
+	else
+		pthread_barrier_wait(& core_barrier);
 }
 
 void cpu_ici(uint core)
 {
 	assert(core < ncores);
 	raise_interrupt(& CORE[core], ICI);
+	if(sim_mode) sim_point();
 }
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
@@ -1098,6 +1491,8 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 
 int cpu_interrupts_enabled()
 {
+	if(sim_mode) sim_point();
+
 	sigset_t curss;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
 	return sigismember(&curss, SIGUSR1)==0;
@@ -1113,6 +1508,7 @@ int cpu_disable_interrupts()
 void cpu_enable_interrupts()
 {
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	if(sim_mode) sim_point();
 }
 
 
@@ -1147,6 +1543,13 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 
 TimerDuration bios_set_timer(TimerDuration usec)
 {
+	if(sim_mode) {
+		Core* core = curr_core();
+		TimerDuration old = (core->sim_alarm > sim_clock) ? core->sim_alarm - sim_clock : 0;
+		core->sim_alarm = (usec > 0) ? sim_clock + usec : 0;
+		return old;
+	}
+
 	time_t sec = usec / 1000000;
 	long nsec = (usec % 1000000) * 1000ull;
 	
@@ -1171,10 +1574,27 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
+	if(sim_mode) {
+		sim_point();
+		return sim_clock;
+	}
 	return get_coarse_time();
 }	
 
 
+TimerDuration bios_precise_clock()
+{
+	if(sim_mode) {
+		sim_point();
+		return sim_clock;
+	}
+
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
+
 
 uint bios_serial_ports()
 {
@@ -1207,6 +1627,7 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
  */
 int bios_read_serial(uint serial, char* ptr)
 {
+	if(sim_mode) sim_point();
 	return io_device_read(& TERM[serial].kbd, ptr);
 }
 
@@ -1217,6 +1638,7 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
+	if(sim_mode) sim_point();
 	return io_device_write(& TERM[serial].con, value);
 }
 
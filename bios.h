@@ -98,6 +98,27 @@
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	Deterministic simulation
+	------------------------
+
+	Normally, the cores run in parallel, on host threads, and the timers
+	are driven by the host clock. Therefore, two runs of the same program
+	may interleave differently, and the timing of the cores suffers from
+	host jitter.
+
+	A VM may instead be booted in _simulation mode_ (see @c vm_config.sim_seed).
+	Then, only one core runs at a time, and the cores change hands only in
+	BIOS calls (reading the clocks, enabling interrupts, sending an ICI, 
+	halting, etc.); the next core to run is chosen by a pseudo-random generator
+	with the given seed. The clocks return a virtual time, which advances by 
+	1 usec at each BIOS call, and jumps forward when all cores are halted. The
+	timers and the serial timeouts expire on this virtual time. Thus, a program 
+	that makes the same BIOS calls sees the same interleaving and the same times 
+	at every run with the same seed, except for any input from the terminals.
+
+	In simulation mode, a core only loses the CPU in BIOS calls. A core which 
+	waits for another core in a loop that makes no BIOS call never stops.
+
  */
 
 
@@ -198,6 +219,12 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief The seed of a deterministic simulation, or 0 to run in real time.
+
+		If this is not 0, the VM runs in simulation mode (see @ref bios.h).
+	*/
+	uint64_t sim_seed;
 } vm_config;
 
 
@@ -233,6 +260,10 @@ int vm_config_terminals(vm_config* vmc, uint serialno, int nowait);
 	Note that this function will block until the terminal emulators
 	are executed.
 
+	The VM runs in real time, unless the environment variable 
+	@c TINYOS_SIM_SEED is set to a non-zero seed for a deterministic
+	simulation.
+
 	@param vmc the configuration to initialize
 	@param bootfunc the boot function to execute on cores
 	@param cores the number of cores
@@ -382,6 +413,25 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief A deadline for @c cpu_core_halt_until() that never expires.
+*/
+#define HALT_FOREVER ((TimerDuration)-1)
+
+/**
+	@brief Halt the core until an interrupt arrives, or a deadline passes.
+
+	This is like @c cpu_core_halt(), except that the core is not woken up
+	periodically. It blocks until an interrupt arrives for the core, or until 
+	the time reaches @c deadline, whichever happens first. If @c deadline is 
+	@c HALT_FOREVER, only an interrupt can wake up the core.
+
+	@param deadline the wakeup time, on the same clock as @c bios_clock()
+	@see cpu_core_halt
+*/
+void cpu_core_halt_until(TimerDuration deadline);
+
+
 /**
 	@brief Restart the given core.
 
@@ -484,6 +534,17 @@ TimerDuration bios_cancel_timer();
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a high-resolution clock.
+
+	This function returns a monotonic clock value, in usec. Its values
+	are not related to those of @c bios_clock(), but its resolution is 
+	that of the host's monotonic clock, so that it is suitable for 
+	measuring short durations.
+ */
+TimerDuration bios_precise_clock();
+
+
 
 
 /**
@@ -24,40 +24,220 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	blocking mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	A thread that has spun for a while on a mutex held by another thread
+ 	blocks, and the holder inherits its priority (see set_inherited_priority()).
+ 	Just yielding is not enough: a high-priority thread that yields is picked
+ 	again right away, and a low-priority holder on the same core would never
+ 	run to release the mutex. A holder may hold several mutexes that threads
+ 	are blocked on. It counts them, and keeps the best priority it inherited
+ 	until it unlocks the last of them.
+
+ 	The mutex word is 0 when the mutex is free. Else, it is the TCB of the
+ 	holder (or NULL, for a spinlock) ORed with MUTEX_HELD, and with
+ 	MUTEX_WAITERS if threads are blocked on it. The blocked threads are kept
+ 	in a small hash table of wait lists, keyed by the address of the mutex.
+ 	A holder that finds MUTEX_WAITERS set when it unlocks wakes up all the
+ 	threads blocked on the mutex, and they try again.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
+
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+#define MUTEX_WAITERS ((Mutex)2)
+#define MUTEX_OWNER(w) ((TCB*)((w) & ~(MUTEX_HELD|MUTEX_WAITERS)))
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+/* A thread blocked on a mutex */
+typedef struct mutex_waiter {
+	Mutex* lock;
+	TCB* thread;
+	struct mutex_waiter* next;
+	int removed;		/* set when the waiter is taken off the list */
+} mutex_waiter;
+
+#define MUTEX_WAIT_BUCKETS 64
+
+/* A wait list of the hash table, protected by a spinlock */
+typedef struct mutex_bucket {
+	Mutex lock;
+	mutex_waiter* waiters;
+} mutex_bucket;
+
+static mutex_bucket mutex_wait_table[MUTEX_WAIT_BUCKETS];
+
+#define MUTEX_BUCKET(lock) (&mutex_wait_table[((uintptr_t)(lock) >> 4) % MUTEX_WAIT_BUCKETS])
+
+/* The holder of the kernel lock (see below) */
+static TCB* kernel_owner = NULL;
+
+/*
+  The current thread, without turning preemption off as cur_thread() does,
+  since this is done at every lock. The thread may move to another core
+  while we look, so we check that the core has not changed after the read.
+*/
+static inline TCB* mutex_self()
+{
+	uint core;
+	TCB* self;
+	do {
+		core = __atomic_load_n(&cpu_core_id, __ATOMIC_RELAXED);
+		self = __atomic_load_n(&cctx[core].current_thread, __ATOMIC_RELAXED);
+	} while(core != __atomic_load_n(&cpu_core_id, __ATOMIC_RELAXED));
+	return self;
+}
+
+static inline int mutex_try(Mutex* lock, Mutex value)
+{
+	Mutex free = MUTEX_INIT;
+	return __atomic_compare_exchange_n(lock, &free, value, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void mutex_pause()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+	__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
+}
+
+void spin_lock(Mutex* lock)
+{
+  while(! mutex_try(lock, MUTEX_HELD)) {
+    int spin=MUTEX_SPINS;
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+      mutex_pause();
+      if(spin>0)
+      	spin--;
+      else {
+      	spin=MUTEX_SPINS;
       	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
+      		yield(SCHED_MUTEX);
+      }
+    }
+  }
+}
+
+/*
+  Block the current thread on a mutex, until the holder unlocks it. Return
+  at once if the mutex is free, or held with no holder recorded (then, the
+  caller just yields).
+*/
+static int mutex_block(Mutex* lock, TCB* self)
+{
+	int preempt = preempt_off;
+	mutex_bucket* bucket = MUTEX_BUCKET(lock);
+	spin_lock(&bucket->lock);
+
+	/* Ask the holder to wake us up */
+	Mutex w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	int marked = 0;
+	while(MUTEX_OWNER(w) != NULL && !(w & MUTEX_WAITERS)) {
+		if(__atomic_compare_exchange_n(lock, &w, w | MUTEX_WAITERS, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			marked = 1;
+			break;
+		}
+	}
+
+	TCB* owner = MUTEX_OWNER(w);
+	if(owner == NULL) {
+		spin_unlock(&bucket->lock);
+		if(preempt) preempt_on;
+		return 0;
+	}
+
+	/* The holder counts the mutexes it holds with waiters, the count drops
+	   in mutex_wake(), which needs this bucket */
+	if(marked)
+		__atomic_fetch_add(&owner->contended_locks, 1, __ATOMIC_RELAXED);
+
+	/* The holder cannot finish unlocking, and go away, before we release
+	   the bucket, so it is safe to pass it our priority */
+	int level = effective_priority(self);
+	if(level < owner->inherited)
+		set_inherited_priority(owner, level);
+
+	mutex_waiter waiter = { .lock = lock, .thread = self, .next = bucket->waiters, .removed = 0 };
+	bucket->waiters = &waiter;
+	sleep_releasing(STOPPED, &bucket->lock, SCHED_MUTEX, NO_TIMEOUT);
+
+	/* Woke up, tidy up */
+	spin_lock(&bucket->lock);
+	if(! waiter.removed) {
+		mutex_waiter** p = &bucket->waiters;
+		while(*p != &waiter) p = &(*p)->next;
+		*p = waiter.next;
+	}
+	spin_unlock(&bucket->lock);
+
+	if(preempt) preempt_on;
+	return 1;
+}
+
+/*
+  Wake up the threads blocked on a mutex that its holder just unlocked. If
+  the holder holds no other mutex with waiters, it drops the priority it
+  inherited. A thread that holds the kernel lock keeps it, until it
+  releases the kernel lock.
+*/
+static void mutex_wake(Mutex* lock, TCB* holder)
+{
+	int preempt = preempt_off;
+	mutex_bucket* bucket = MUTEX_BUCKET(lock);
+	spin_lock(&bucket->lock);
+	mutex_waiter** p = &bucket->waiters;
+	while(*p != NULL) {
+		mutex_waiter* waiter = *p;
+		if(waiter->lock == lock) {
+			TCB* thread = waiter->thread;
+			*p = waiter->next;
+			waiter->removed = 1;
+			wakeup(thread);
+		} else
+			p = &waiter->next;
+	}
+	int contended = __atomic_sub_fetch(&holder->contended_locks, 1, __ATOMIC_RELAXED);
+	spin_unlock(&bucket->lock);
+
+	if(contended == 0 && holder->inherited != QUEUE_AMOUNT && holder != kernel_owner)
+		set_inherited_priority(holder, QUEUE_AMOUNT);
+	if(preempt) preempt_on;
+}
+
+void Mutex_Lock(Mutex* lock)
+{
+  TCB* self = mutex_self();
+  Mutex me = (Mutex)self | MUTEX_HELD;
+
+  while(! mutex_try(lock, me)) {
+    int spin=MUTEX_SPINS;
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+      mutex_pause();
+      if(spin>0)
+      	spin--;
+      else {
+      	spin=MUTEX_SPINS;
+      	if(cpu_interrupts_enabled()) {
+      		/* The idle thread must never sleep */
+      		if(self == NULL || self->type == IDLE_THREAD || !mutex_block(lock, self))
+      			yield(SCHED_MUTEX);
+      	}
       }
     }
   }
-#undef MUTEX_SPINS
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  Mutex w = __atomic_exchange_n(lock, MUTEX_INIT, __ATOMIC_RELEASE);
+  if(w & MUTEX_WAITERS)
+  	mutex_wake(lock, MUTEX_OWNER(w));
 }
 
 
@@ -194,10 +374,30 @@ void Cond_Signal(CondVar* cv)
 }
 
 
+/* The number of waiters woken up together by Cond_Broadcast */
+#define BROADCAST_BATCH 64
+
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  while(cv->waitset) {
+    /* Take a batch of waiters off the ring, and wake them up together */
+    __cv_waiter* batch[BROADCAST_BATCH];
+    TCB* threads[BROADCAST_BATCH];
+    int n = 0;
+    while(cv->waitset && n < BROADCAST_BATCH) {
+      __cv_waiter* waiter = cv->waitset;
+      remove_from_ring(cv, waiter);
+      waiter->removed = 1;
+      batch[n] = waiter;
+      threads[n] = waiter->thread;
+      n++;
+    }
+
+    wakeup_many(threads, n);
+    for(int i=0; i<n; i++)
+      if(threads[i] != NULL) batch[i]->signalled = 1;
+  }
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -219,6 +419,11 @@ void Cond_Broadcast(CondVar* cv)
  * The main advantage is that @c kernel_mutex is held for a very short time
  * regardless of contention. Thus, in multicore machines, it allows for cores
  * to be passed to other threads. 
+ *
+ * The holder of the kernel lock inherits the best priority of the threads
+ * waiting for it (see @c set_inherited_priority()). Otherwise, a low-priority
+ * holder that is starved by other threads would also stall every
+ * high-priority thread that needs the kernel.
  * 
  */
 
@@ -231,13 +436,77 @@ static int kernel_sem = 1;
 /* Semaphore condition */
 static CondVar kernel_sem_cv = COND_INIT;
 
+/*
+  Pass the priority of a thread that is about to wait for the kernel 
+  semaphore to its holder. 
+
+  *** MUST BE CALLED WITH kernel_mutex HELD ***
+*/
+static void kernel_lock_inherit(TCB* waiter)
+{
+	if (kernel_owner == NULL || waiter == NULL)
+		return;
+	int level = effective_priority(waiter);
+	if (level < kernel_owner->inherited)
+		set_inherited_priority(kernel_owner, level);
+}
+
+/*
+  Record the current thread as the holder of the kernel semaphore. It 
+  inherits the priority of the threads that already wait for it.
+
+  *** MUST BE CALLED WITH kernel_mutex HELD ***
+*/
+static void kernel_lock_acquired()
+{
+	TCB* self = cur_thread();
+	kernel_owner = self;
+	if (self == NULL)
+		return;
+
+	int level = QUEUE_AMOUNT;
+	Mutex_Lock(&kernel_sem_cv.waitset_lock);
+	__cv_waiter* first = kernel_sem_cv.waitset;
+	if (first != NULL) {
+		__cv_waiter* w = first;
+		do {
+			int wlevel = effective_priority(w->thread);
+			if (wlevel < level)
+				level = wlevel;
+			w = w->node.next->obj;
+		} while (w != first);
+	}
+	Mutex_Unlock(&kernel_sem_cv.waitset_lock);
+
+	if (level < QUEUE_AMOUNT)
+		set_inherited_priority(self, level);
+}
+
+/*
+  The holder releases the kernel semaphore and drops any inherited priority,
+  unless it holds a mutex that other threads are blocked on (kernel_mutex
+  itself, for one). Then, the priority is dropped in mutex_wake().
+
+  *** MUST BE CALLED WITH kernel_mutex HELD ***
+*/
+static void kernel_lock_released()
+{
+	TCB* self = kernel_owner;
+	kernel_owner = NULL;
+	if (self != NULL && self->inherited != QUEUE_AMOUNT
+		&& __atomic_load_n(&self->contended_locks, __ATOMIC_RELAXED) == 0)
+		set_inherited_priority(self, QUEUE_AMOUNT);
+}
+
 void kernel_lock()
 {
 	Mutex_Lock(& kernel_mutex);
 	while(kernel_sem<=0) {
+		kernel_lock_inherit(cur_thread());
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
 	}
 	kernel_sem--;
+	kernel_lock_acquired();
 	Mutex_Unlock(& kernel_mutex);
 }
 
@@ -245,6 +514,7 @@ void kernel_unlock()
 {
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
+	kernel_lock_released();
 	Cond_Signal(&kernel_sem_cv);
 	Mutex_Unlock(& kernel_mutex);
 }
@@ -255,14 +525,18 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
+	kernel_lock_released();
 	Cond_Signal(&kernel_sem_cv);	
 
 	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
 
 	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
+	while(kernel_sem<=0) {
+		kernel_lock_inherit(cur_thread());
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	}
 	kernel_sem--;
+	kernel_lock_acquired();
 	Mutex_Unlock(& kernel_mutex);		
 
 	return ret;
@@ -282,10 +556,7 @@ void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
+	kernel_lock_released();
 	Cond_Signal(&kernel_sem_cv);
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
 }
-
-
-
-
@@ -81,6 +81,43 @@ void kernel_broadcast(CondVar* cv);
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
+/*
+ * Spinlocks.
+ * The scheduler locks its own data with these, instead of Mutex_Lock.
+ */
+
+/** @brief The value of a mutex locked by @c spin_lock, which records no holder. */
+#define MUTEX_HELD ((Mutex)1)
+
+/**
+	@brief Lock a mutex as a spinlock.
+
+	Unlike @c Mutex_Lock, the caller never blocks (it only yields while
+	preemption is on), and the holder does not inherit its priority.
+	A mutex locked by @c Mutex_Lock must not be unlocked while a scheduler
+	spinlock is held, since waking up its blocked threads needs the scheduler.
+	Therefore, the locks that the scheduler takes are spinlocks.
+  */
+void spin_lock(Mutex* lock);
+
+/**
+	@brief Try to lock a spinlock without waiting.
+	@returns 1 on success, 0 if the mutex is locked
+  */
+static inline int spin_trylock(Mutex* lock)
+{
+	Mutex free = MUTEX_INIT;
+	return __atomic_compare_exchange_n(lock, &free, MUTEX_HELD, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/** @brief Unlock a mutex locked by @c spin_lock or @c spin_trylock. */
+static inline void spin_unlock(Mutex* lock)
+{
+	__atomic_store_n(lock, MUTEX_INIT, __ATOMIC_RELEASE);
+}
+
+
 
 /** @brief Set the preemption status for the current core.
 
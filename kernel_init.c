@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_trace.h"
 
 
 
@@ -26,6 +27,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  sched_policy policy;
 } boot_rec;
 
 
@@ -38,7 +40,8 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_trace(cpu_cores());
+    initialize_scheduler(boot_rec.policy);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -53,19 +56,34 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  /* Wait until every core has stopped */
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+    sched_latency_report(stderr);
+    stack_usage_report(stderr);
   }
 }
 
 
-void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+void boot_with_policy(uint ncores, uint nterm, sched_policy policy, Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
+  boot_rec.policy = policy;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  /* Dump the scheduler trace, if it is on */
+  finalize_trace();
+}
+
+
+void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_with_policy(ncores, nterm, SCHED_POLICY_MLFQ, boot_task, argl, args);
 }
 
 
@@ -36,6 +36,15 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
   pcb->thread_count = 0;
+  pcb->vruntime = 0;
+  pcb->usage = (cpu_usage){ 0 };
+  pcb->child_usage = (cpu_usage){ 0 };
+  pcb->gang = 0;
+  pcb->gang_lock = MUTEX_INIT;
+  rlnode_init(& pcb->gang_ready, NULL);
+  pcb->quota = pcb->quota_period = 0;
+  pcb->quota_used = pcb->quota_refill = 0;
+  pcb->quota_lock = MUTEX_INIT;
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
@@ -85,6 +94,11 @@ PCB* acquire_PCB()
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
+    pcb->usage = (cpu_usage){ 0 };
+    pcb->child_usage = (cpu_usage){ 0 };
+    pcb->gang = 0;
+    pcb->quota = 0;
+    pcb->vruntime = 0;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
@@ -177,6 +191,10 @@ Pid_t sys_Exec(Task call, int argl, void* args)
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+
+    /* Inherit the CPU quota, with a budget of its own */
+    if(curproc->quota > 0)
+      set_process_quota(newproc, curproc->quota, curproc->quota_period);
   }
 
 
@@ -207,7 +225,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlnode* ptcb_node = rlnode_init(& ptcb->ptcb_list_node, ptcb);
     rlist_push_back(& newproc->ptcb_list, ptcb_node);
 
-    TCB* tcb = spawn_thread(newproc, start_main_thread);
+    TCB* tcb = spawn_thread(newproc, start_main_thread, call, 0);
     ptcb->tcb = tcb;
     tcb->ptcb = ptcb;
     newproc->thread_count++;
@@ -238,6 +256,10 @@ static void cleanup_zombie(PCB* pcb, int* status)
   if(status != NULL)
     *status = pcb->exitval;
 
+  /* The parent inherits the CPU usage of the child */
+  cpu_usage_add(& CURPROC->child_usage, & pcb->usage);
+  cpu_usage_add(& CURPROC->child_usage, & pcb->child_usage);
+
   rlist_remove(& pcb->children_node);
   rlist_remove(& pcb->exited_node);
 
@@ -342,8 +364,64 @@ void sys_Exit(int exitval)
 
 
 
+int sys_GetProcessUsage(Pid_t pid, cpu_usage* self, cpu_usage* children)
+{
+  PCB* pcb = (pid < 0 || pid >= MAX_PROC) ? NULL : get_pcb(pid);
+  if(pcb == NULL)
+    return -1;
+
+  if(self != NULL) {
+    /* The exited threads, plus the live ones */
+    *self = pcb->usage;
+    rlnode* list = & pcb->ptcb_list;
+    for(rlnode* p = list->next; p != list; p = p->next) {
+      if(! p->ptcb->exited) {
+        cpu_usage u;
+        get_thread_usage(p->ptcb->tcb, &u);
+        cpu_usage_add(self, &u);
+      }
+    }
+  }
+
+  if(children != NULL)
+    *children = pcb->child_usage;
+
+  return 0;
+}
+
+
 Fid_t sys_OpenInfo()
 {
 	return NOFILE;
 }
 
+
+int sys_SetGangMode(int on)
+{
+  return set_process_gang(CURPROC, on);
+}
+
+
+int sys_SetProcessQuota(Pid_t pid, unsigned long quota, unsigned long period)
+{
+  PCB* pcb = (pid == NOPROC) ? CURPROC : 
+    (pid < 0 || pid >= MAX_PROC) ? NULL : get_pcb(pid);
+  if(pcb == NULL || pcb->pstate != ALIVE || (quota > 0 && period == 0))
+    return -1;
+
+  set_process_quota(pcb, quota, period);
+  return 0;
+}
+
+
+int sys_GetProcessQuota(Pid_t pid, unsigned long* quota, unsigned long* period)
+{
+  PCB* pcb = (pid == NOPROC) ? CURPROC : 
+    (pid < 0 || pid >= MAX_PROC) ? NULL : get_pcb(pid);
+  if(pcb == NULL || pcb->pstate != ALIVE)
+    return -1;
+
+  if(quota != NULL) *quota = pcb->quota;
+  if(period != NULL) *period = pcb->quota_period;
+  return 0;
+}
@@ -63,6 +63,21 @@ typedef struct process_control_block {
   rlnode ptcb_list;
   int thread_count;
 
+  TimerDuration vruntime; /**< @brief The virtual runtime of the process, used by the fair policy */
+
+  cpu_usage usage;        /**< @brief CPU usage of the exited threads of the process */
+  cpu_usage child_usage;  /**< @brief CPU usage of the reaped children (and their reaped children) */
+
+  int gang;               /**< @brief Non-zero if the process is in gang mode (see @c SetGangMode()) */
+  Mutex gang_lock;        /**< @brief Protects @c gang_ready */
+  rlnode gang_ready;      /**< @brief The queued threads of the process, while in gang mode */
+
+  TimerDuration quota;        /**< @brief CPU time allowed per quota period (usec), or 0 for no quota */
+  TimerDuration quota_period; /**< @brief The quota period (usec) */
+  TimerDuration quota_used;   /**< @brief CPU time used in the current quota period */
+  TimerDuration quota_refill; /**< @brief The end of the current quota period */
+  Mutex quota_lock;           /**< @brief Protects the quota fields */
+
 } PCB;
 
 
@@ -1,10 +1,13 @@
 
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_sched.h"
+#include "kernel_trace.h"
 #include "tinyos.h"
 
 #ifndef NVALGRIND
@@ -36,8 +39,20 @@ CCB cctx[MAX_CORES];
 */
 #define CURTHREAD (CURCORE.current_thread)
 
-#define QUEUE_AMOUNT 10 /* Amount of total priority queues */
-#define MAX_ITERATIONS 1000  /* At how many iterations of the scheduler the priority of all threads is incremented */
+/* The queue bitmap of a core must have a bit for each priority level */
+_Static_assert(QUEUE_AMOUNT <= 32, "QUEUE_AMOUNT does not fit in the queue bitmap");
+
+/* The fields that the priority queue scans read, including the inherited
+   level used by mlfq_level(), must fit in the first cache line of the TCB,
+   and the key fields of the fair queue in the second. */
+_Static_assert(offsetof(TCB, enqueue_time) + sizeof(TimerDuration) <= CACHE_LINE_SIZE,
+	"The priority queue fields of the TCB do not fit in its first cache line");
+_Static_assert(offsetof(TCB, fair_node) >= CACHE_LINE_SIZE
+	&& offsetof(TCB, vruntime) + sizeof(TimerDuration) <= 2*CACHE_LINE_SIZE,
+	"The fair queue fields of the TCB do not fit in its second cache line");
+
+/* The scheduling policy of normal threads, chosen at boot */
+static const sched_policy_ops* sched_ops;
 
 /*
 	This can be used in the preemptive context to
@@ -94,43 +109,353 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/*
+  Thread memory.
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+  A thread block is allocated in one of two ways, chosen at boot: by
+  malloc (the default), or by mmap, if the environment variable 
+  TINYOS_THREAD_MEM is "mmap".
 
-/*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  The mmap blocks are carved out of large regions, reserved with no access
+  (and no swap), THREAD_REGION_BLOCKS blocks at a time. A block is committed
+  (made accessible) when first used, except for a guard page between the 
+  TCB and the stack, so that a stack overflow is a segmentation fault, 
+  instead of corrupting the TCB. Pages are only resident once touched. 
+  A freed block returns its pages to the host (MADV_DONTNEED), and is kept 
+  in a free list for reuse; the regions are never unmapped.
+
+  Only blocks with the default stack size come from the regions. A block 
+  with another stack size (see CreateThreadEx) is mapped on its own, with 
+  the same layout and guard page, and is unmapped when freed.
+
+  In both modes, the block starts with the TCB, as in the layout above.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+enum { THREAD_MEM_MALLOC, THREAD_MEM_MMAP };
+static int thread_mem = THREAD_MEM_MALLOC;
 
-void* allocate_thread(size_t size)
-{
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+/* The size of the guard page of the current mode */
+static size_t thread_guard = 0;
 
+/* The size of a thread block in the current mode, for a given stack size */
+#define THREAD_BLOCK_SIZE_FOR(stack_size) (THREAD_TCB_SIZE + thread_guard + (stack_size))
+
+/* The size of a thread block in the current mode, for the default stack size */
+#define THREAD_BLOCK_SIZE THREAD_BLOCK_SIZE_FOR(THREAD_STACK_SIZE)
+
+/* The lowest address of the stack of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) + THREAD_TCB_SIZE + thread_guard)
+
+/* The number of blocks of an mmap region */
+#define THREAD_REGION_BLOCKS 1024
+
+static Mutex thread_region_spinlock = MUTEX_INIT;
+static void* thread_region_free = NULL;  /* Freed mmap blocks */
+static char* thread_region_next = NULL;  /* The unused part of the last region */
+static char* thread_region_end = NULL;
+
+/* Reserve memory with no access */
+static void* mmap_reserve(size_t len)
+{
+	void* ptr = mmap(NULL, len, PROT_NONE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	return ptr;
+}
 
+static void* mmap_thread(size_t size)
+{
+	void* ptr;
+	if (size != THREAD_BLOCK_SIZE) {
+		ptr = mmap_reserve(size);
+		goto commit;
+	}
+
+	spin_lock(&thread_region_spinlock);
+	ptr = thread_region_free;
+	if (ptr != NULL) {
+		thread_region_free = *(void**)ptr;
+		spin_unlock(&thread_region_spinlock);
+		return ptr;  /* Already committed */
+	}
+
+	if (thread_region_next == NULL || (size_t)(thread_region_end - thread_region_next) < size) {
+		size_t len = THREAD_REGION_BLOCKS * size;
+		thread_region_next = mmap_reserve(len);
+		thread_region_end = thread_region_next + len;
+	}
+	ptr = thread_region_next;
+	thread_region_next += size;
+	spin_unlock(&thread_region_spinlock);
+
+commit:
+
+	/* Commit the TCB and the stack, leaving the guard page in between */
+	CHECK(mprotect(ptr, THREAD_TCB_SIZE, PROT_READ | PROT_WRITE));
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE, size - THREAD_TCB_SIZE - SYSTEM_PAGE_SIZE,
+		PROT_READ | PROT_WRITE));
 	return ptr;
 }
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+
+static void munmap_thread(void* ptr, size_t size)
+{
+	if (size != THREAD_BLOCK_SIZE) {
+		CHECK(munmap(ptr, size));
+		return;
+	}
+
+	/* Give the pages back, but keep the block */
+	CHECK(madvise(ptr, size, MADV_DONTNEED));
+	spin_lock(&thread_region_spinlock);
+	*(void**)ptr = thread_region_free;
+	thread_region_free = ptr;
+	spin_unlock(&thread_region_spinlock);
+}
+
+void free_thread(void* ptr, size_t size)
+{
+	if (thread_mem == THREAD_MEM_MMAP)
+		munmap_thread(ptr, size);
+	else
+		free(ptr);
+}
 
 void* allocate_thread(size_t size)
 {
+	if (thread_mem == THREAD_MEM_MMAP)
+		return mmap_thread(size);
+
 	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
 	CHECK((ptr == NULL) ? -1 : 0);
 	return ptr;
 }
-#endif
 
 
+/*
+  Thread recycling.
+
+  The memory block of an exited thread with the default stack size is 
+  kept for reuse by the next such thread created: first in the cache of the core where the thread exited 
+  (up to THREAD_CACHE_SIZE blocks), then in a global pool (up to
+  thread_pool_cap blocks); beyond that, it is freed. A core only uses its 
+  own cache, with preemption off, so the cache needs no lock. A kept block 
+  is linked to the next one through its first word.
+
+  With mmap thread memory, a kept block gives the pages of its stack back
+  to the host (MADV_DONTNEED), so that the kept blocks only hold their
+  TCBs in memory. The stack pages stay committed, and are zero-filled again
+  when the next thread touches them.
+
+  The cached blocks outlive a boot of the VM, so that the next boot 
+  starts with them.
+ */
+static void* thread_pool = NULL;
+static uint thread_pooled = 0;
+static uint thread_pool_cap = THREAD_POOL_SIZE;
+static Mutex thread_pool_spinlock = MUTEX_INIT;
+
+/* Return a thread block of the given size, reusing a kept one if possible */
+static void* thread_block_get(size_t size)
+{
+	if (size != THREAD_BLOCK_SIZE)
+		return allocate_thread(size);
+
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	void* block = core->thread_cache;
+	if (block != NULL) {
+		core->thread_cache = *(void**)block;
+		core->thread_cached--;
+	} else if (thread_pool != NULL) {
+		spin_lock(&thread_pool_spinlock);
+		block = thread_pool;
+		if (block != NULL) {
+			thread_pool = *(void**)block;
+			thread_pooled--;
+		}
+		spin_unlock(&thread_pool_spinlock);
+	}
+	if (block != NULL)
+		core->threads_reused++;
+
+	if (preempt)
+		preempt_on;
+	return (block != NULL) ? block : allocate_thread(THREAD_BLOCK_SIZE);
+}
+
+/* Release the stack pages of a block that is kept for reuse */
+static inline void thread_block_trim(void* block)
+{
+	if (thread_mem == THREAD_MEM_MMAP)
+		CHECK(madvise(THREAD_STACK(block), THREAD_STACK_SIZE, MADV_DONTNEED));
+}
+
+/* Keep the block of an exited thread for reuse, or free it (non-preemptive) */
+static void thread_block_put(void* block, size_t size)
+{
+	if (size != THREAD_BLOCK_SIZE) {
+		free_thread(block, size);
+		return;
+	}
+
+	CCB* core = &CURCORE;
+	if (core->thread_cached < THREAD_CACHE_SIZE) {
+		thread_block_trim(block);
+		*(void**)block = core->thread_cache;
+		core->thread_cache = block;
+		core->thread_cached++;
+		return;
+	}
+
+	/* Trim before locking the pool, to keep the system call out of the lock */
+	thread_block_trim(block);
+	spin_lock(&thread_pool_spinlock);
+	if (thread_pooled < thread_pool_cap) {
+		*(void**)block = thread_pool;
+		thread_pool = block;
+		thread_pooled++;
+		block = NULL;
+	}
+	spin_unlock(&thread_pool_spinlock);
+
+	if (block != NULL)
+		free_thread(block, THREAD_BLOCK_SIZE);
+}
+
+/* Free all the kept thread blocks. This is called at boot, with one core running. */
+static void thread_cache_flush()
+{
+	for (uint c = 0; c < MAX_CORES; c++) {
+		while (cctx[c].thread_cache != NULL) {
+			void* block = cctx[c].thread_cache;
+			cctx[c].thread_cache = *(void**)block;
+			free_thread(block, THREAD_BLOCK_SIZE);
+		}
+		cctx[c].thread_cached = 0;
+	}
+	while (thread_pool != NULL) {
+		void* block = thread_pool;
+		thread_pool = *(void**)block;
+		free_thread(block, THREAD_BLOCK_SIZE);
+	}
+	thread_pooled = 0;
+}
+
+
+/*
+  Stack accounting.
+
+  When it is on (TINYOS_STACK is set at boot), the stack of a new thread
+  is painted with STACK_PAINT. When the thread is released, its stack is 
+  scanned from the lowest address (stacks grow down) to the first word that
+  was overwritten, to find its deepest use. This is recorded for the task 
+  of the thread, in a table of STACK_TASKS records, by open addressing on 
+  the task address; tasks that do not fit are not recorded.
+
+  In the "auto" mode, a task whose STACK_AUTO_SAMPLES threads have been
+  measured gets twice the deepest use, plus STACK_AUTO_SLACK for the signal 
+  handlers, as the default stack size of its new threads (if it is smaller 
+  than THREAD_STACK_SIZE). A thread that overwrote the whole pattern may 
+  have overflowed, so its task is no longer auto-sized. Auto-sizing is only
+  done with mmap thread memory: without a guard page, a thread that goes
+  deeper than its task's sampled threads would silently overwrite the memory
+  below its stack, where its TCB is. With malloc memory, "auto" only reports.
+
+  Painting touches the whole stack, so with mmap thread memory it commits 
+  all of its pages.
+ */
+enum { STACK_OFF, STACK_REPORT, STACK_AUTO };
+static int stack_mode = STACK_OFF;
+
+#define STACK_PAINT 0xa5a5a5a5a5a5a5a5UL
+#define STACK_AUTO_SLACK (8 * 1024)
+
+typedef struct stack_record {
+	Task task;             /* NULL for a free record */
+	unsigned long threads; /* The threads measured */
+	size_t max_used;       /* Their deepest stack use */
+	size_t max_size;       /* Their largest stack */
+	size_t auto_size;      /* The default stack size of the task, 0 if not auto-sized */
+	int full;              /* Non-zero if a thread used its whole stack */
+} stack_record;
+
+static stack_record stack_table[STACK_TASKS];
+static Mutex stack_spinlock = MUTEX_INIT;
+
+/* Return the record of a task, adding it if asked, or NULL (stack_spinlock held) */
+static stack_record* stack_lookup(Task task, int add)
+{
+	uint h = ((uintptr_t) task >> 4) % STACK_TASKS;
+	for (uint i = 0; i < STACK_TASKS; i++) {
+		stack_record* r = &stack_table[(h + i) % STACK_TASKS];
+		if (r->task == task)
+			return r;
+		if (r->task == NULL) {
+			if (add)
+				r->task = task;
+			return add ? r : NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Return the default stack size of the new threads of a task */
+static size_t stack_default_size(Task task)
+{
+	size_t size = 0;
+	if (stack_mode == STACK_AUTO && task != NULL) {
+		spin_lock(&stack_spinlock);
+		stack_record* r = stack_lookup(task, 0);
+		if (r != NULL)
+			size = r->auto_size;
+		spin_unlock(&stack_spinlock);
+	}
+	return (size != 0) ? size : THREAD_STACK_SIZE;
+}
+
+static void stack_paint(TCB* tcb)
+{
+	unsigned long* stack = THREAD_STACK(tcb);
+	size_t n = tcb->stack_size / sizeof(unsigned long);
+	for (size_t i = 0; i < n; i++)
+		stack[i] = STACK_PAINT;
+}
+
+/* Record the deepest stack use of an exited thread */
+static void stack_measure(TCB* tcb)
+{
+	unsigned long* stack = THREAD_STACK(tcb);
+	size_t n = tcb->stack_size / sizeof(unsigned long);
+	size_t i = 0;
+	while (i < n && stack[i] == STACK_PAINT)
+		i++;
+	size_t used = (n - i) * sizeof(unsigned long);
+
+	if (tcb->task == NULL)
+		return;
+	spin_lock(&stack_spinlock);
+	stack_record* r = stack_lookup(tcb->task, 1);
+	if (r != NULL) {
+		r->threads++;
+		if (used > r->max_used)
+			r->max_used = used;
+		if (tcb->stack_size > r->max_size)
+			r->max_size = tcb->stack_size;
+		if (i == 0)
+			r->full = 1;
+
+		r->auto_size = 0;
+		if (stack_mode == STACK_AUTO && !r->full && r->threads >= STACK_AUTO_SAMPLES) {
+			size_t size = 2 * r->max_used + STACK_AUTO_SLACK;
+			size = ((size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+			if (size < THREAD_STACK_MIN)
+				size = THREAD_STACK_MIN;
+			if (size < THREAD_STACK_SIZE)
+				r->auto_size = size;
+		}
+	}
+	spin_unlock(&stack_spinlock);
+}
 
 
 /*
@@ -138,6 +463,7 @@ void* allocate_thread(size_t size)
 */
 
 void gain(int preempt); /* forward */
+static uint sched_affine_core(uint32_t mask); /* forward */
 
 static void thread_start()
 {
@@ -152,10 +478,15 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), Task task, size_t stack_size)
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	if (stack_size == 0)
+		stack_size = stack_default_size(task);
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+	TCB* tcb = (TCB*)thread_block_get(THREAD_BLOCK_SIZE_FOR(stack_size));
+	tcb->stack_size = stack_size;
+	tcb->task = task;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -168,34 +499,63 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->wakeup_time = NO_TIMEOUT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
+	/* The new thread inherits the affinity of its creator */
+	TCB* creator = CURCORE.current_thread; /* NULL while booting */
+	tcb->affinity = (creator != NULL && creator->type != IDLE_THREAD) ? creator->affinity : ~0u;
+
+	/* The new thread starts at the creator's core (if allowed); idle cores will steal it */
+	tcb->core = (tcb->affinity & (1u << cpu_core_id)) ? cpu_core_id : sched_affine_core(tcb->affinity);
+
+	tcb->last_core = tcb->core;
+	tcb->last_run = 0;
+
+	/* New threads are not real-time */
+	tcb->rt = 0;
+
+	tcb->usage = (cpu_usage){ 0 };
+	tcb->usage_stamp = 0;
+	tcb->ready_stamp = NO_TIMEOUT;
+
+	/* The virtual runtime is set when the thread is first made ready */
+	tcb->vruntime = 0;
+	tcb->fair_node.tcb = tcb;
+	rlnode_init(&tcb->gang_node, tcb);
+	tcb->throttled = 0;
+
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
-    /* The priority of the new thread is set to the highest on init */
-    tcb->priority = 0;
+    /* The new thread inherits the nice value of its creator, and starts at the
+       highest priority that it allows */
+    tcb->nice = (creator != NULL && creator->type != IDLE_THREAD) ? creator->nice : 0;
+    tcb->priority = NICE_PRIORITY(tcb->nice);
+    tcb->inherited = QUEUE_AMOUNT;
+	tcb->contended_locks = 0;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = THREAD_STACK(tcb);
+	if (stack_mode != STACK_OFF)
+		stack_paint(tcb);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
+	spin_lock(&active_threads_spinlock);
 	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	spin_unlock(&active_threads_spinlock);
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called with the sched_spinlock of the core locked !
  */
 void release_TCB(TCB* tcb)
 {
@@ -203,11 +563,14 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (stack_mode != STACK_OFF)
+		stack_measure(tcb);
 
-	Mutex_Lock(&active_threads_spinlock);
+	thread_block_put(tcb, THREAD_BLOCK_SIZE_FOR(tcb->stack_size));
+
+	spin_lock(&active_threads_spinlock);
 	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	spin_unlock(&active_threads_spinlock);
 }
 
 /*
@@ -221,264 +584,1650 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  The scheduler queues are kept per core, in the CCB. Each core has an
+  array of doubly linked lists (one per priority level), the lists of its 
+  real-time threads (ready or throttled), and a timer wheel of its sleeping
+  threads with a timeout. 
+
+  All of these structures are protected by the core's @c sched_spinlock,
+  so that cores do not contend with each other on yield(), gain() and
+  wakeup().
+
+  Every thread belongs to exactly one core, designated by tcb->core, and its
+  state and phase are also protected by the sched_spinlock of that core.
+  A thread changes core only when it is stolen: an idle core takes a READY
+  thread from the queues of some other core, while holding both spinlocks.
 */
 
-rlnode SCHED[QUEUE_AMOUNT];
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+/* Interrupt handler for ALARM. If the alarm was set before the end of the
+   time-slice (see gain()), the thread is preempted rather than demoted. */
+void yield_handler() { yield(CURCORE.alarm_rest > 0 ? SCHED_PREEMPT : SCHED_QUANTUM); }
 
-/* Interrupt handle for inter-core interrupts */
+/* Interrupt handler for inter-core interrupts. They wake up halted cores,
+   and preempt cores where a more urgent thread became ready. */
 void ici_handler()
-{ /* noop for now... */
+{
+	if (CURCORE.need_resched && CURTHREAD->type != IDLE_THREAD)
+		yield(SCHED_PREEMPT);
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Bit mask of the cores whose idle thread is about to halt, or is halted.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  An idle core sets its bit before it checks for work, and a core that makes
+  a thread ready checks the mask after it has queued the thread. Both use 
+  sequentially consistent accesses, so either the idle core sees the thread,
+  or the waker sees the bit and interrupts the core.
 */
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
-{
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+static uint32_t idle_cores = 0;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+/*
+  Wake up an idle core to run a thread just queued at the given core. 
+  The owner of the queue is preferred, else any idle core in the thread's 
+  affinity mask will do (it will steal the thread). The bit of the chosen 
+  core is cleared, so that the next call wakes up a different core.
+*/
+static void sched_kick(CCB* core, uint32_t mask)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint32_t idle;
+	while ((idle = __atomic_load_n(&idle_cores, __ATOMIC_RELAXED) & mask) != 0) {
+		uint c = (idle & (1u << core->id)) ? core->id : (uint)__builtin_ctz(idle);
+		uint32_t cmask = 1u << c;
+		if (__atomic_fetch_and(&idle_cores, ~cmask, __ATOMIC_SEQ_CST) & cmask) {
+			cpu_ici(c);
+			return;
+		}
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Choose a core for a thread with the given affinity, that must move off
+  its current core. An idle core is preferred.
 */
-static void sched_queue_add(TCB* tcb)
+static uint sched_affine_core(uint32_t mask)
 {
-    /* We push the thread to the appropriate priority queue */
-    rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	uint ncores = cpu_cores();
+	if (ncores < 32)
+		mask &= (1u << ncores) - 1;
+	assert(mask != 0);
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	uint32_t idle = __atomic_load_n(&idle_cores, __ATOMIC_RELAXED) & mask;
+	return __builtin_ctz(idle ? idle : mask);
+}
+
+/* 
+  Try to lock a spinlock without waiting. Return 1 on success.
+  This is used when a core already holds its own spinlock, so that 
+  two cores locking each other's queues cannot deadlock.
+*/
+static inline int sched_trylock(Mutex* lock)
+{
+	return spin_trylock(lock);
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+  Lock the core that the thread belongs to, and return it.
+  Because tcb->core may change while we wait for the lock, we check it
+  again once the lock is held.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static CCB* sched_lock_thread(TCB* tcb)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
-
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+	while (1) {
+		uint c = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		CCB* core = &cctx[c];
+		spin_lock(&core->sched_spinlock);
+		if (__atomic_load_n(&tcb->core, __ATOMIC_RELAXED) == c)
+			return core;
+		spin_unlock(&core->sched_spinlock);
 	}
+}
 
-	/* Mark as ready */
-	tcb->state = READY;
+/*
+  Push a thread to the back of the core's ready queue for priority 'prio',
+  marking the level as non-empty.
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static inline void sched_queue_push(CCB* core, int prio, TCB* tcb, TimerDuration now)
+{
+	tcb->enqueue_time = now;
+	rlist_push_back(&core->sched_queue[prio], &tcb->sched_node);
+	core->queue_bitmap |= (1u << prio);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Remove a thread from the core's ready queue for priority 'prio', clearing
+  the level's bit if the queue becomes empty.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static inline TCB* sched_queue_unlink(CCB* core, int prio, TCB* tcb)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(&core->sched_queue[prio]))
+		core->queue_bitmap &= ~(1u << prio);
+	return tcb;
+}
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
-	}
+/*
+  The MLFQ level of a thread, including its inherited priority. Since a 
+  queued thread is unlinked from this level, it only changes while the 
+  thread is not queued (see set_inherited_priority()).
+*/
+static inline int mlfq_level(TCB* tcb)
+{
+	return (tcb->inherited < tcb->priority) ? tcb->inherited : tcb->priority;
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Promote the threads that have waited longer than AGING_INTERVAL at their
+  level. Since each queue is FIFO, only the heads need to be examined, and
+  each promoted thread restarts its wait at the new level. This costs
+  O(QUEUE_AMOUNT) plus O(1) per promoted thread, and is only done when the
+  (coarse) clock has moved.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
+static void sched_age_queues(CCB* core, TimerDuration now)
 {
-	/* Iterating through every queue, when a non empty queue is found
-	 * the top thread of the queue is selected */
+	if (now == core->last_aging)
+		return;
+	core->last_aging = now;
+
+	/* The top level cannot be promoted */
+	uint32_t levels = core->queue_bitmap & ~1u;
+	while (levels) {
+		int prio = __builtin_ctz(levels);
+		levels &= levels - 1;
+
+		rlnode* queue = &core->sched_queue[prio];
+		while (!is_rlist_empty(queue) && now - queue->next->tcb->enqueue_time >= AGING_INTERVAL) {
+			TCB* tcb = sched_queue_unlink(core, prio, queue->next->tcb);
+			change_priority(tcb, 1);
+			sched_queue_push(core, mlfq_level(tcb), tcb, now);
+		}
+	}
+}
 
-    int priority_selection = 0; /* This is used for selecting each priority queue */
-    rlnode* sel;
-    TCB* next_thread;
+/*
+  Timeouts.
 
-    /* Iterating through every queue, and attempting to get the first
-     * thread. When it's successful it's set for the new cycle */
-    do{
-        sel = rlist_pop_front(&SCHED[priority_selection++]);
-        next_thread = sel->tcb;
-    }while((next_thread == NULL) && priority_selection < QUEUE_AMOUNT);
+  Each core keeps its sleeping threads with a timeout in a hierarchical
+  timing wheel (see timer_wheel). Time is measured in ticks of 
+  TIMER_WHEEL_TICK usec, and a thread expires at the first tick not 
+  earlier than its wakeup_time. The node used is tcb->sched_node, since a 
+  sleeping thread is not in any ready queue.
+*/
 
-    /* If no threads are waiting we attempt to execute the current thread again */
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+#define TIMER_WHEEL_MASK ((TimerDuration)(TIMER_WHEEL_SLOTS - 1))
+#define TIMER_WHEEL_RANGE ((TimerDuration)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
 
-	next_thread->its = QUANTUM;
+static void timer_wheel_init(timer_wheel* tw, TimerDuration now)
+{
+	tw->now = now / TIMER_WHEEL_TICK;
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		tw->bitmap[l] = 0;
+		for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			rlnode_init(&tw->slot[l][i], NULL);
+	}
+}
 
-	return next_thread;
+/*
+  Place a thread in the slot of the wheel that corresponds to its wakeup time.
+*/
+static void timer_wheel_insert(timer_wheel* tw, TCB* tcb)
+{
+	/* Round up, so that we never wake up early */
+	TimerDuration expires = (tcb->wakeup_time + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK;
+	if (expires < tw->now)
+		expires = tw->now;
+
+	/* Park far timeouts at the end of the wheel, they will be re-cascaded */
+	if (expires - tw->now >= TIMER_WHEEL_RANGE)
+		expires = tw->now + TIMER_WHEEL_RANGE - 1;
+
+	/* Find the lowest level whose span covers the timeout */
+	TimerDuration delta = expires - tw->now;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((TimerDuration)1 << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	uint slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	rlist_push_back(&tw->slot[level][slot], &tcb->sched_node);
+	tw->bitmap[level] |= (1ull << slot);
 }
 
 /*
-  Make the process ready.
- */
-int wakeup(TCB* tcb)
+  Return the next tick at which some slot of the wheel must be visited, 
+  either to expire (level 0) or to cascade (higher levels) its threads.
+  Return NO_TIMEOUT if the wheel is empty.
+*/
+static TimerDuration timer_wheel_next_tick(timer_wheel* tw)
 {
-	int ret = 0;
+	TimerDuration next = NO_TIMEOUT;
+
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		uint64_t bm = tw->bitmap[l];
+		if (bm == 0)
+			continue;
+
+		int shift = TIMER_WHEEL_BITS * l;
+		TimerDuration cur = tw->now >> shift;
+		uint idx = cur & TIMER_WHEEL_MASK;
+
+		/* The current slot is still due only if we are exactly at its start */
+		int due_now = (tw->now & (((TimerDuration)1 << shift) - 1)) == 0;
+		uint64_t ahead = due_now ? (bm & (~0ull << idx))
+		                         : (idx == TIMER_WHEEL_SLOTS - 1 ? 0 : bm & (~0ull << (idx + 1)));
+
+		TimerDuration base = cur & ~TIMER_WHEEL_MASK;
+		TimerDuration tick = ahead ? (base + __builtin_ctzll(ahead)) << shift
+		                           : (base + TIMER_WHEEL_SLOTS + __builtin_ctzll(bm)) << shift;
+		if (tick < next)
+			next = tick;
+	}
 
-	/* Preemption off */
-	int oldpre = preempt_off;
+	return next;
+}
+
+/*
+  Possibly add TCB to the core's timer wheel.
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_register_timeout(CCB* core, TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
+		timer_wheel_insert(&core->timeouts, tcb);
 	}
+}
 
-	Mutex_Unlock(&sched_spinlock);
+/* The cores a thread may be queued at */
+static inline uint32_t sched_allowed(TCB* tcb)
+{
+	return tcb->rt ? (1u << tcb->rt_core) : tcb->affinity;
+}
 
-	/* Restore preemption state */
-	if (oldpre)
-		preempt_on;
+/* The utilization reserved by a real-time thread */
+static inline uint64_t rt_utilization(TimerDuration runtime, TimerDuration period)
+{
+	return (runtime * RT_UTIL_ONE) / period;
+}
 
-	return ret;
+/*
+  Start a new period for a real-time thread, at time 'start'.
+*/
+static inline void sched_rt_new_period(TCB* tcb, TimerDuration start)
+{
+	tcb->rt_budget = tcb->rt_runtime;
+	tcb->rt_abs_deadline = start + tcb->rt_deadline;
+	tcb->rt_release = start + tcb->rt_period;
 }
 
 /*
-  Atomically put the current process to sleep, after unlocking mx.
- */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
-	TimerDuration timeout)
+  Insert a real-time thread into a list kept sorted by 'key'. The search 
+  starts from the back, since new keys tend to be the latest.
+*/
+static void sched_rt_insert(rlnode* list, TCB* tcb, TimerDuration key, int by_release)
 {
-	assert(state == STOPPED || state == EXITED);
+	rlnode* n = list->prev;
+	while (n != list && (by_release ? n->tcb->rt_release : n->tcb->rt_abs_deadline) > key)
+		n = n->prev;
+	rl_splice(n, &tcb->sched_node);
+}
 
+/*
+  The fair policy.
+
+  The fair policy shares the CPU among processes, and the CPU time of each
+  process among its threads. Each process has a virtual runtime, which is
+  charged with the CPU time of all of its threads, on every core. Each thread
+  also has a virtual runtime of its own, charged with its own CPU time.
+
+  The fair tree of a core holds a group for each process with ready threads
+  at the core (see fair_group), ordered by the virtual runtime of the process.
+  The process with the least virtual runtime runs next, and among its threads
+  at the core, the thread with the least virtual runtime. Therefore, a process
+  with many threads gets about the share of a process with one, even when its
+  threads spread over several cores.
+
+  The virtual runtime of a process may be advanced by other cores at any
+  time, so the key of a group may fall behind it. The key is refreshed when
+  the group is requeued, and when it comes first in the tree (see fair_first()).
+
+  A thread that inherits priority from the waiters of a lock it holds is
+  keyed before all others, and so is its process, until it releases the lock.
+*/
 
-	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+/* The hash bucket of the groups of a process */
+#define FAIR_BUCKET(pcb) (get_pid(pcb) % FAIR_GROUP_BUCKETS)
 
-	/* mark the thread as stopped or exited */
-	tcb->state = state;
+/* A thread with inherited priority goes before all others */
+static inline TimerDuration fair_key(TCB* tcb)
+{
+	return (tcb->inherited < QUEUE_AMOUNT) ? 0 : tcb->vruntime;
+}
 
-	/* register the timeout (if any) for the sleeping thread */
-	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+/* The virtual runtime of a process, which other cores may advance */
+static inline TimerDuration fair_vruntime(PCB* pcb)
+{
+	return __atomic_load_n(&pcb->vruntime, __ATOMIC_RELAXED);
+}
 
-	/* Release mx */
-	if (mx != NULL)
-		Mutex_Unlock(mx);
+/* Raise the virtual runtime of a process to at least 'floor' */
+static void fair_raise(PCB* pcb, TimerDuration floor)
+{
+	TimerDuration v = fair_vruntime(pcb);
+	while (v < floor && !__atomic_compare_exchange_n(&pcb->vruntime, &v, floor, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+/* A process with a thread of inherited priority goes before all others */
+static inline TimerDuration fair_group_key(fair_group* g)
+{
+	return (g->boosted > 0) ? 0 : fair_vruntime(g->pcb);
+}
 
-	/* call this to schedule someone else */
-	yield(cause);
+static fair_group* fair_group_find(CCB* core, PCB* pcb)
+{
+	fair_group* g = core->fair_groups[FAIR_BUCKET(pcb)];
+	while (g != NULL && g->pcb != pcb)
+		g = g->next;
+	return g;
+}
 
-	/* Restore preemption state */
-	if (preempt)
-		preempt_on;
+/* Get an empty group for a process, from the free list if possible */
+static fair_group* fair_group_acquire(CCB* core, PCB* pcb)
+{
+	fair_group* g = core->fair_free;
+	if (g != NULL)
+		core->fair_free = g->next;
+	else {
+		g = malloc(sizeof(fair_group));
+		CHECK((g == NULL) ? -1 : 0);
+	}
+
+	g->node.obj = g;
+	g->threads = NULL;
+	g->pcb = pcb;
+	g->boosted = 0;
+
+	fair_group** bucket = &core->fair_groups[FAIR_BUCKET(pcb)];
+	g->next = *bucket;
+	*bucket = g;
+	return g;
 }
 
-/* This function is the entry point to the scheduler's context switching */
+/* Return an empty group to the free list */
+static void fair_group_release(CCB* core, fair_group* g)
+{
+	fair_group** p = &core->fair_groups[FAIR_BUCKET(g->pcb)];
+	while (*p != g)
+		p = &(*p)->next;
+	*p = g->next;
 
-void yield(enum SCHED_CAUSE cause)
+	g->next = core->fair_free;
+	core->fair_free = g;
+}
+
+/* Insert a group into the fair tree, with its current key */
+static inline void fair_group_insert(CCB* core, fair_group* g)
 {
-    int static iteration = MAX_ITERATIONS;
+	g->node.key = fair_group_key(g);
+	core->fair_tree = treap_insert(core->fair_tree, &g->node);
+}
 
+/*
+  Return the group with the least key in the fair tree, or NULL. Since the
+  key of a group can only fall behind the virtual runtime of its process,
+  the first group is re-inserted until its key is up to date. It is then
+  the true first.
+*/
+static fair_group* fair_first(CCB* core)
+{
+	while (core->fair_tree != NULL) {
+		fair_group* g = treap_min(core->fair_tree)->obj;
+		if (g->node.key == fair_group_key(g))
+			return g;
+		core->fair_tree = treap_remove(core->fair_tree, &g->node);
+		fair_group_insert(core, g);
+	}
+	return NULL;
+}
 
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
+/*
+  Find the least virtual runtime among the threads of a process at the core,
+  other than 'tcb': the ready ones in group 'g' (which may be NULL), and the
+  current thread (if any). Return 0 if there is none.
+*/
+static int fair_sibling_min(CCB* core, fair_group* g, TCB* tcb, TimerDuration* least)
+{
+	int found = 0;
+	if (g != NULL && g->threads != NULL) {
+		*least = treap_min(g->threads)->tcb->vruntime;
+		found = 1;
+	}
 
-	/* We must stop preemption but save it! */
-	int preempt = preempt_off;
+	TCB* current = core->current_thread;
+	if (current != NULL && current != tcb && current->owner_pcb == tcb->owner_pcb && current->type != IDLE_THREAD
+		&& !current->rt && (!found || current->vruntime < *least)) {
+		*least = current->vruntime;
+		found = 1;
+	}
+	return found;
+}
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+static void fair_enqueue(CCB* core, TCB* tcb)
+{
+	PCB* pcb = tcb->owner_pcb;
+	fair_group* g = fair_group_find(core, pcb);
+
+	/* A thread that was asleep gets only a limited credit over its siblings */
+	TimerDuration least;
+	if (fair_sibling_min(core, g, tcb, &least) && least > FAIR_WAKEUP_CREDIT
+		&& tcb->vruntime < least - FAIR_WAKEUP_CREDIT)
+		tcb->vruntime = least - FAIR_WAKEUP_CREDIT;
+
+	if (g != NULL)
+		core->fair_tree = treap_remove(core->fair_tree, &g->node);
+	else {
+		/* Likewise, a process that was asleep, over the other processes of the core */
+		TCB* current = core->current_thread;
+		if ((current == NULL || current->owner_pcb != pcb) && core->min_vruntime > FAIR_WAKEUP_CREDIT)
+			fair_raise(pcb, core->min_vruntime - FAIR_WAKEUP_CREDIT);
+		g = fair_group_acquire(core, pcb);
+	}
 
-	Mutex_Lock(&sched_spinlock);
-    iteration--;
-    if(iteration == 0){
-        increase_all_priorities();
-        iteration = MAX_ITERATIONS;
-    }
+	if (tcb->inherited < QUEUE_AMOUNT)
+		g->boosted++;
+	tcb->fair_node.key = fair_key(tcb);
+	g->threads = treap_insert(g->threads, &tcb->fair_node);
+	fair_group_insert(core, g);
+}
 
-	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
-		current->state = READY;
+static void fair_dequeue(CCB* core, TCB* tcb)
+{
+	fair_group* g = fair_group_find(core, tcb->owner_pcb);
+	core->fair_tree = treap_remove(core->fair_tree, &g->node);
 
-	/* Update CURTHREAD scheduler data */
-	current->rts = remaining;
-	current->last_cause = current->curr_cause;
-	current->curr_cause = cause;
+	g->threads = treap_remove(g->threads, &tcb->fair_node);
+	if (tcb->inherited < QUEUE_AMOUNT)
+		g->boosted--;
 
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	if (g->threads != NULL)
+		fair_group_insert(core, g);
+	else
+		fair_group_release(core, g);
+}
 
-    /* Depending on the reason the yield was cause the current thread
-     * priority is addapted */
-    switch(cause){
-        case SCHED_QUANTUM:
-            change_priority(current, 0);
-            break;
-        case SCHED_IO:
-            change_priority(current, 1);
-            break;
-        case SCHED_MUTEX:
-            if (current->last_cause == current->curr_cause)
-                change_priority(current, 0);
-            break;
-        default:
-            break;
-    }
+/*
+  The process of the current thread goes on, unless another process is
+  behind it. Then, the current thread goes on, unless a thread of its
+  process is behind it.
+*/
+static TCB* fair_pick_next(CCB* core, TCB* current, TimerDuration now)
+{
+	fair_group* first = fair_first(core);
+
+	if (current != NULL) {
+		TimerDuration key = (current->inherited < QUEUE_AMOUNT) ? 0 : fair_vruntime(current->owner_pcb);
+		if (first == NULL || key <= first->node.key) {
+			fair_group* own = (first != NULL && first->pcb == current->owner_pcb)
+				? first : fair_group_find(core, current->owner_pcb);
+			if (own != NULL) {
+				tnode* t = treap_min(own->threads);
+				if (t->key < fair_key(current))
+					return t->tcb;
+			}
+			return current;
+		}
+	}
+
+	return (first != NULL) ? treap_min(first->threads)->tcb : NULL;
+}
+
+/*
+  The weight of each nice value. A thread's virtual runtime advances in 
+  inverse proportion to its weight, and each step is about 1.25 times the
+  next one (as in Linux).
+*/
+#define NICE_0_WEIGHT 1024
+static const unsigned int nice_weight[MAX_NICE + 1] = {
+	1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45, 36, 29, 23, 18, 15
+};
+
+/*
+  Charge a thread of the fair policy, and its process, for 'used' usec of
+  CPU time.
+*/
+static inline void fair_charge(TCB* tcb, TimerDuration used)
+{
+	TimerDuration delta = used * NICE_0_WEIGHT / nice_weight[tcb->nice];
+	tcb->vruntime += delta;
+	__atomic_fetch_add(&tcb->owner_pcb->vruntime, delta, __ATOMIC_RELAXED);
+}
+
+/*
+  Advance the core's min_vruntime to the least virtual runtime among the
+  processes of the core, including the process of the current thread if
+  it is ready.
+*/
+static void fair_update_min(CCB* core, TCB* current)
+{
+	int found = 0;
+	TimerDuration least = 0;
+
+	fair_group* first = fair_first(core);
+	if (first != NULL) {
+		/* While a process with inherited priority is first, the least
+		   virtual runtime is not known, and the update waits */
+		if (first->boosted > 0)
+			return;
+		least = first->node.key;
+		found = 1;
+	}
+	if (current->state == READY && current->type != IDLE_THREAD && !current->rt) {
+		TimerDuration v = fair_vruntime(current->owner_pcb);
+		if (!found || v < least) {
+			least = v;
+			found = 1;
+		}
+	}
+
+	if (found && least > core->min_vruntime)
+		core->min_vruntime = least;
+}
+
+static void fair_on_yield(CCB* core, TCB* current, enum SCHED_CAUSE cause, TimerDuration used)
+{
+	if (current->type != IDLE_THREAD)
+		fair_charge(current, used);
+	fair_update_min(core, current);
+}
+
+/*
+  A new thread starts at the least virtual runtime of its siblings at its
+  core. A new process starts at the least virtual runtime of its core.
+*/
+static void fair_on_wakeup(CCB* core, TCB* tcb)
+{
+	if (tcb->state == INIT) {
+		PCB* pcb = tcb->owner_pcb;
+		if (pcb->thread_count == 1)
+			fair_raise(pcb, core->min_vruntime);
+
+		TimerDuration least;
+		tcb->vruntime = fair_sibling_min(core, fair_group_find(core, pcb), tcb, &least) ? least : 0;
+	}
+}
+
+/*
+  CPU quotas.
+
+  The CPU time of the (normal) threads of a process with a quota is charged 
+  to the process at yield(). When the budget of the current period is used
+  up, its threads are parked in the quota_throttled list of their core 
+  instead of being queued, until the period ends. A thread is also parked
+  when it is selected to run while its process is out of budget, and the
+  time-slice of a selected thread does not exceed the budget left. 
+  
+  Each period starts when the previous one ends, or, if the process was not
+  charged for longer than a period, when it is next checked. Time used
+  beyond the budget is charged to the next period.
+*/
+
+/*
+  Check the quota of a process at time 'now', starting a new period if the
+  current one is over. Return the end of the period if the process is out
+  of budget, else return 0 and store in *left the budget left.
+*/
+static TimerDuration sched_quota_check(PCB* pcb, TimerDuration now, TimerDuration* left)
+{
+	*left = NO_TIMEOUT;
+	if (__atomic_load_n(&pcb->quota, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	TimerDuration until = 0;
+	spin_lock(&pcb->quota_lock);
+	if (pcb->quota > 0) {
+		if (now >= pcb->quota_refill) {
+			pcb->quota_refill = (now - pcb->quota_refill < pcb->quota_period) 
+				? pcb->quota_refill + pcb->quota_period : now + pcb->quota_period;
+			pcb->quota_used = (pcb->quota_used > pcb->quota) ? pcb->quota_used - pcb->quota : 0;
+		}
+		if (pcb->quota_used >= pcb->quota)
+			until = pcb->quota_refill;
+		else
+			*left = pcb->quota - pcb->quota_used;
+	}
+	spin_unlock(&pcb->quota_lock);
+	return until;
+}
+
+/* Charge a process with a quota for 'used' usec of CPU time */
+static void sched_quota_charge(PCB* pcb, TimerDuration used)
+{
+	if (__atomic_load_n(&pcb->quota, __ATOMIC_RELAXED) == 0)
+		return;
+	spin_lock(&pcb->quota_lock);
+	pcb->quota_used += used;
+	spin_unlock(&pcb->quota_lock);
+}
+
+/*
+  Park a ready thread until 'until', by the end of the period.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_quota_park(CCB* core, TCB* tcb, TimerDuration until)
+{
+	tcb->throttled = until;
+	rlnode* n = core->quota_throttled.prev;
+	while (n != &core->quota_throttled && n->tcb->throttled > until)
+		n = n->prev;
+	rl_splice(n, &tcb->sched_node);
+}
+
+void set_process_quota(PCB* pcb, TimerDuration quota, TimerDuration period)
+{
+	spin_lock(&pcb->quota_lock);
+	pcb->quota_period = period;
+	pcb->quota_used = 0;
+	pcb->quota_refill = bios_clock() + period;
+	__atomic_store_n(&pcb->quota, quota, __ATOMIC_RELAXED);
+	spin_unlock(&pcb->quota_lock);
+}
+
+/*
+  Add TCB to the core's ready queues: a real-time thread by its deadline
+  (or to the throttled list, if it has no budget left), any other thread 
+  to the queues of the scheduling policy (or to the quota throttled list,
+  if its process has no budget left).
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_queue_add(CCB* core, TCB* tcb)
+{
+	assert(tcb->core == core->id);
+
+	if (tcb->rt) {
+		if (tcb->rt_budget == 0) {
+			sched_rt_insert(&core->rt_throttled, tcb, tcb->rt_release, 1);
+			return;
+		}
+		sched_rt_insert(&core->rt_queue, tcb, tcb->rt_abs_deadline, 0);
+
+		/* Preempt the current thread of the core, if it is less urgent */
+		TCB* cur = core->current_thread;
+		if (cur != NULL && cur->type != IDLE_THREAD 
+			&& (!cur->rt || cur->rt_abs_deadline > tcb->rt_abs_deadline)) {
+			core->need_resched = 1;
+			cpu_ici(core->id);
+		}
+	} else {
+		PCB* pcb = tcb->owner_pcb;
+		TimerDuration left;
+		TimerDuration until = sched_quota_check(pcb, bios_clock(), &left);
+		if (until != 0) {
+			sched_quota_park(core, tcb, until);
+			return;
+		}
+
+		sched_ops->enqueue(core, tcb);
+		core->queued++;
+
+		if (pcb->gang) {
+			spin_lock(&pcb->gang_lock);
+			rlist_push_back(&pcb->gang_ready, &tcb->gang_node);
+			spin_unlock(&pcb->gang_lock);
+		}
+	}
+
+	/* Wake up a halted core, if any */
+	sched_kick(core, sched_allowed(tcb));
+}
+
+/*
+  A thread that leaves the ready queues of its core is no longer the handoff 
+  thread of the core that woke it. The handoff is cleared atomically, since 
+  that core does not hold the lock of ours. So, while our core is locked, a 
+  non-NULL handoff is still queued here (see sched_handoff_take()).
+
+  *** MUST BE CALLED WITH THE SPINLOCK OF THE THREAD'S CORE HELD ***
+*/
+static inline void sched_handoff_cancel(TCB* tcb)
+{
+	CCB* waker = tcb->handoff_waker;
+	if (waker != NULL) {
+		TCB* expected = tcb;
+		__atomic_compare_exchange_n(&waker->handoff, &expected, NULL, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		tcb->handoff_waker = NULL;
+	}
+}
+
+/*
+  Remove a queued (READY and CLEAN) thread from the core's queues.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_remove(CCB* core, TCB* tcb)
+{
+	if (tcb->rt)
+		rlist_remove(&tcb->sched_node);
+	else if (tcb->throttled) {
+		rlist_remove(&tcb->sched_node);
+		tcb->throttled = 0;
+	} else {
+		sched_ops->dequeue(core, tcb);
+		core->queued--;
+
+		/* Other threads may change the links of the node, but cannot make
+		   it empty, so the check needs no lock */
+		if (!is_rlist_empty(&tcb->gang_node)) {
+			spin_lock(&tcb->owner_pcb->gang_lock);
+			rlist_remove(&tcb->gang_node);
+			spin_unlock(&tcb->owner_pcb->gang_lock);
+		}
+	}
+	sched_handoff_cancel(tcb);
+	return tcb;
+}
+
+/*
+  Return true if the thread is in the ready queues of its core. By the
+  scheduler invariant, this is the case iff it is READY and CLEAN.
+
+  *** MUST BE CALLED WITH THE SPINLOCK OF THE THREAD'S CORE HELD ***
+*/
+static inline int sched_is_queued(TCB* tcb)
+{
+	return tcb->state == READY && tcb->phase == CTX_CLEAN;
+}
+
+/* A racy check for ready normal threads at a core, used to avoid locking it */
+static inline int sched_peek_queued(CCB* core)
+{
+	return __atomic_load_n(&core->queued, __ATOMIC_RELAXED) != 0;
+}
+
+/*
+  Give a new period to the throttled real-time threads whose replenishment
+  time has come, and queue them. If a thread was throttled for more than a
+  period, its new period starts now.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_rt_replenish(CCB* core, TimerDuration now)
+{
+	while (!is_rlist_empty(&core->rt_throttled)) {
+		TCB* tcb = core->rt_throttled.next->tcb;
+		if (tcb->rt_release > now)
+			break;
+
+		rlist_remove(&tcb->sched_node);
+		sched_rt_new_period(tcb, (now - tcb->rt_release < tcb->rt_period) ? tcb->rt_release : now);
+		sched_queue_add(core, tcb);
+	}
+}
+
+/*
+  Queue the threads parked by the quota of their process, whose period
+  has ended.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_quota_release(CCB* core, TimerDuration now)
+{
+	while (!is_rlist_empty(&core->quota_throttled)) {
+		TCB* tcb = core->quota_throttled.next->tcb;
+		if (tcb->throttled > now)
+			break;
+
+		rlist_remove(&tcb->sched_node);
+		tcb->throttled = 0;
+		sched_queue_add(core, tcb);
+	}
+}
+
+/*
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH core->sched_spinlock HELD ***
+ */
+static void sched_make_ready(CCB* core, TCB* tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timer wheel (the slot bit is cleared lazily) */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		/* tcb is in the timer wheel, fix it */
+		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		rlist_remove(&tcb->sched_node);
+		tcb->wakeup_time = NO_TIMEOUT;
+	}
+
+	if (!tcb->rt && sched_ops->on_wakeup != NULL)
+		sched_ops->on_wakeup(core, tcb);
+
+	/* Mark as ready */
+	tcb->state = READY;
+	tcb->ready_stamp = bios_precise_clock();
+	if (tcb->phase == CTX_CLEAN)
+		tcb->usage_stamp = tcb->ready_stamp; /* The wait starts */
+
+	/* A real-time thread that wakes up after its period (or deadline) is over
+	   starts a new period */
+	if (tcb->rt) {
+		TimerDuration now = bios_clock();
+		if (now >= tcb->rt_release || now >= tcb->rt_abs_deadline)
+			sched_rt_new_period(tcb, now);
+	}
+
+	/* Possibly add to the scheduler queue */
+	if (tcb->phase == CTX_CLEAN)
+		sched_queue_add(core, tcb);
+}
+
+/*
+  Advance the core's timer wheel up to the current time, waking up the
+  threads whose timeout has expired. Empty stretches of the wheel are
+  skipped, so the cost is proportional to the number of slots visited,
+  not to the time elapsed.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_wakeup_expired_timeouts(CCB* core)
+{
+	timer_wheel* tw = &core->timeouts;
+	TimerDuration target = bios_clock() / TIMER_WHEEL_TICK;
+	TimerDuration t;
+
+	while ((t = timer_wheel_next_tick(tw)) <= target) {
+		tw->now = t;
+
+		/* Cascade the higher levels that start a new slot at t, highest first */
+		for (int l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+			if (t & (((TimerDuration)1 << (TIMER_WHEEL_BITS * l)) - 1))
+				continue;
+			uint idx = (t >> (TIMER_WHEEL_BITS * l)) & TIMER_WHEEL_MASK;
+			rlnode* slot = &tw->slot[l][idx];
+			tw->bitmap[l] &= ~(1ull << idx);
+			while (!is_rlist_empty(slot))
+				timer_wheel_insert(tw, rlist_pop_front(slot)->tcb);
+		}
+
+		/* Expire the level-0 slot of t */
+		uint idx = t & TIMER_WHEEL_MASK;
+		rlnode* slot = &tw->slot[0][idx];
+		while (!is_rlist_empty(slot)) {
+			trace_event(TRACE_TIMEOUT, slot->next->tcb, NULL, 0);
+			sched_make_ready(core, slot->next->tcb);
+		}
+		tw->bitmap[0] &= ~(1ull << idx);
+
+		tw->now = t + 1;
+	}
+
+	if (tw->now <= target)
+		tw->now = target + 1;
+}
+
+/*
+  The number of threads examined when looking for a thread with a warm
+  (or cold) cache, before settling for the first candidate.
+*/
+#define SCHED_LOOKAHEAD 4
+
+/* Return true if the thread probably still has a warm cache at its last core. */
+static inline int sched_cache_hot(TCB* tcb, TimerDuration now)
+{
+	return tcb->last_run != 0 && now - tcb->last_run < CACHE_HOT_TIME;
+}
+
+/*
+  Search the tree of a fair group for a thread to steal, in order of
+  decreasing virtual runtime, as in mlfq_find_stealable().
+*/
+static void fair_search_stealable(tnode* t, uint32_t cmask, TimerDuration now,
+	TCB** first, TCB** cold, int* seen)
+{
+	if (t == NULL || *cold != NULL || *seen >= SCHED_LOOKAHEAD)
+		return;
+
+	fair_search_stealable(t->right, cmask, now, first, cold, seen);
+	if (*cold != NULL || *seen >= SCHED_LOOKAHEAD)
+		return;
+
+	if (t->tcb->affinity & cmask) {
+		if (!sched_cache_hot(t->tcb, now)) {
+			*cold = t->tcb;
+			return;
+		}
+		if (*first == NULL)
+			*first = t->tcb;
+		(*seen)++;
+	}
+
+	fair_search_stealable(t->left, cmask, now, first, cold, seen);
+}
+
+/* Search the groups of a fair tree, in order of decreasing virtual runtime */
+static void fair_search_groups(tnode* g, uint32_t cmask, TimerDuration now,
+	TCB** first, TCB** cold, int* seen)
+{
+	if (g == NULL || *cold != NULL || *seen >= SCHED_LOOKAHEAD)
+		return;
+
+	fair_search_groups(g->right, cmask, now, first, cold, seen);
+	fair_search_stealable(((fair_group*)g->obj)->threads, cmask, now, first, cold, seen);
+	fair_search_groups(g->left, cmask, now, first, cold, seen);
+}
+
+static TCB* fair_find_stealable(CCB* victim, uint32_t cmask, TimerDuration now)
+{
+	TCB* first = NULL;
+	TCB* cold = NULL;
+	int seen = 0;
+	fair_search_groups(victim->fair_tree, cmask, now, &first, &cold, &seen);
+	return (cold != NULL) ? cold : first;
+}
+
+/*
+  Find a thread of the victim's queues that may run on the core(s) of
+  'cmask'. The queues are searched from the lowest priority, and each
+  queue from its tail, since these are the threads the victim would run last.
+  Among the first few candidates, a thread whose cache has gone cold is
+  preferred, since moving it costs the least.
+
+  *** MUST BE CALLED WITH victim->sched_spinlock HELD ***
+*/
+static TCB* mlfq_find_stealable(CCB* victim, uint32_t cmask, TimerDuration now)
+{
+	TCB* first = NULL;
+	int seen = 0;
+
+	uint32_t bm = victim->queue_bitmap;
+	while (bm && seen < SCHED_LOOKAHEAD) {
+		int p = 31 - __builtin_clz(bm);
+		rlnode* q = &victim->sched_queue[p];
+		for (rlnode* n = q->prev; n != q && seen < SCHED_LOOKAHEAD; n = n->prev) {
+			if (!(n->tcb->affinity & cmask))
+				continue;
+			if (!sched_cache_hot(n->tcb, now))
+				return n->tcb;
+			if (first == NULL)
+				first = n->tcb;
+			seen++;
+		}
+		bm &= ~(1u << p);
+	}
+
+	return first;
+}
+
+/*
+  Steal a thread from the queues of some other core, for the (idle) core
+  'core'. The victim cores are visited round-robin, starting after 'core'.
+  Victims whose bitmap shows no ready threads are skipped without locking.
+
+  Return NULL if nothing could be stolen.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_steal(CCB* core, TimerDuration now)
+{
+	uint ncores = cpu_cores();
+
+	for (uint i = 1; i < ncores; i++) {
+		CCB* victim = &cctx[(core->id + i) % ncores];
+
+		/* A racy peek, to avoid locking cores with nothing to steal */
+		if (!sched_peek_queued(victim))
+			continue;
+
+		/* Do not wait for a busy victim, we hold our own lock */
+		if (!sched_trylock(&victim->sched_spinlock))
+			continue;
+
+		TCB* tcb = sched_ops->find_stealable(victim, 1u << core->id, now);
+		if (tcb != NULL) {
+			sched_queue_remove(victim, tcb);
+			if (sched_ops->on_migrate != NULL)
+				sched_ops->on_migrate(victim, core, tcb);
+
+			/* Migrate the thread while both cores are locked */
+			__atomic_store_n(&tcb->core, core->id, __ATOMIC_RELEASE);
+			core->migrations++;
+			core->steals++;
+			trace_event(TRACE_MIGRATE, tcb, NULL, victim->id);
+		}
+
+		spin_unlock(&victim->sched_spinlock);
+
+		if (tcb != NULL)
+			return tcb;
+	}
+
+	return NULL;
+}
+
+/*
+  Return a thread near the head of the core's queue 'prio' whose cache is
+  still warm at this core, or else the head of the queue.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_pick_warm(CCB* core, int prio, TimerDuration now)
+{
+	rlnode* q = &core->sched_queue[prio];
+	int seen = 0;
+	for (rlnode* n = q->next; n != q && seen < SCHED_LOOKAHEAD; n = n->next, seen++)
+		if (n->tcb->last_core == core->id && sched_cache_hot(n->tcb, now))
+			return n->tcb;
+	return q->next->tcb;
+}
+
+/*
+  Gang scheduling.
+
+  A process in gang mode keeps its queued threads in its gang_ready list, as
+  well as in the queues of their cores. When a core dispatches a thread of 
+  such a process and the gang slot is free, the process takes the slot for a
+  quantum, and the other cores are interrupted. Until the slot expires, a 
+  core that selects a thread prefers a ready thread of the gang, taking it 
+  from another core if needed. The threads of the gang share the quantum of
+  the slot, so that they are descheduled together.
+
+  The gang lock of a process is taken after a core lock. A core that holds a
+  gang lock only try-locks other cores.
+*/
+
+static Mutex gang_spinlock = MUTEX_INIT;
+static PCB* gang_pcb = NULL;     /* The process holding the gang slot */
+static TimerDuration gang_until; /* When the gang slot expires */
+
+/*
+  Return the process holding the gang slot and set 'until' to the end of 
+  its quantum, or return NULL if the slot is free.
+*/
+static PCB* sched_gang_active(TimerDuration now, TimerDuration* until)
+{
+	/* A racy peek, to avoid the lock when there are no gangs */
+	if (__atomic_load_n(&gang_pcb, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+
+	spin_lock(&gang_spinlock);
+	PCB* g = gang_pcb;
+	if (g != NULL && (now >= gang_until || !g->gang)) {
+		g = NULL;
+		__atomic_store_n(&gang_pcb, NULL, __ATOMIC_RELAXED);
+	}
+	*until = gang_until;
+	spin_unlock(&gang_spinlock);
+	return g;
+}
+
+/*
+  Let the process of a thread just selected at the core take the gang slot, 
+  if it is free, and interrupt the other cores. If its process holds the 
+  slot, the thread runs for the rest of the slot's quantum.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_gang_start(CCB* core, TCB* tcb, TimerDuration now)
+{
+	PCB* pcb = tcb->owner_pcb;
+	int kick = 0;
+
+	spin_lock(&gang_spinlock);
+	if (gang_pcb == NULL || now >= gang_until || !gang_pcb->gang) {
+		__atomic_store_n(&gang_pcb, pcb, __ATOMIC_RELAXED);
+		gang_until = now + QUANTUM;
+		kick = 1;
+	}
+	if (gang_pcb == pcb)
+		tcb->its = gang_until - now;
+	spin_unlock(&gang_spinlock);
+
+	/* A racy check, the other cores will see if there is work for them */
+	if (kick && !is_rlist_empty(&pcb->gang_ready)) {
+		for (uint c = 0; c < cpu_cores(); c++) {
+			if (c == core->id)
+				continue;
+			__atomic_store_n(&cctx[c].need_resched, 1, __ATOMIC_RELAXED);
+			cpu_ici(c);
+		}
+	}
+}
+
+/*
+  Take a queued thread of process 'g' that may run at the core, possibly 
+  from another core, or return NULL.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_gang_take(CCB* core, PCB* g)
+{
+	uint32_t cmask = 1u << core->id;
+	TCB* tcb = NULL;
+	CCB* victim = NULL;
+
+	/* A thread in gang_ready is queued, so it cannot change core while we 
+	   hold the gang lock */
+	spin_lock(&g->gang_lock);
+	for (rlnode* n = g->gang_ready.next; n != &g->gang_ready; n = n->next) {
+		if (!(sched_allowed(n->tcb) & cmask))
+			continue;
+		CCB* c = &cctx[n->tcb->core];
+		if (c == core || sched_trylock(&c->sched_spinlock)) {
+			tcb = n->tcb;
+			victim = c;
+			break;
+		}
+	}
+	spin_unlock(&g->gang_lock);
+
+	if (tcb == NULL)
+		return NULL;
+
+	/* The thread stays queued, since its core is locked */
+	sched_queue_remove(victim, tcb);
+	if (victim != core) {
+		if (sched_ops->on_migrate != NULL)
+			sched_ops->on_migrate(victim, core, tcb);
+		__atomic_store_n(&tcb->core, core->id, __ATOMIC_RELEASE);
+		core->migrations++;
+		trace_event(TRACE_MIGRATE, tcb, NULL, victim->id);
+		spin_unlock(&victim->sched_spinlock);
+	}
+	core->gang_dispatches++;
+	return tcb;
+}
+
+/*
+  While a process holds the gang slot, return the current thread if it is
+  of the gang, else a queued thread of the gang, or NULL. The thread gets 
+  the rest of the slot's quantum.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_gang_select(CCB* core, TCB* current, TimerDuration now)
+{
+	TimerDuration until;
+	PCB* g = sched_gang_active(now, &until);
+	if (g == NULL)
+		return NULL;
+
+	TCB* next = (current != NULL && current->owner_pcb == g) ? current : sched_gang_take(core, g);
+	if (next != NULL)
+		next->its = until - now;
+	return next;
+}
+
+int set_process_gang(PCB* pcb, int on)
+{
+	int old = pcb->gang;
+	pcb->gang = (on != 0);
+	return old;
+}
+
+/*
+  Return the next thread to run at the core. A ready real-time thread with
+  the earliest deadline (possibly the current thread) is preferred. Next, 
+  a thread of the gang that holds the gang slot, if any. Else, the 
+  scheduling policy chooses among the core's queued threads and the
+  current thread. If there is none, try to steal from another core, and 
+  finally return the idle thread. A normal thread whose process is out of
+  CPU quota is parked instead of being selected.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_normal_select(CCB* core, TCB* current, TimerDuration now);
+
+static TCB* sched_queue_select(CCB* core, TCB* current, TimerDuration now)
+{
+    TCB* next_thread = NULL;
+
+	/* Real-time threads come first, earliest deadline first */
+	TCB* rt = is_rlist_empty(&core->rt_queue) ? NULL : core->rt_queue.next->tcb;
+	if (current->rt && current->state == READY && current->rt_budget > 0
+		&& current->rt_core == core->id
+		&& (rt == NULL || current->rt_abs_deadline <= rt->rt_abs_deadline))
+		next_thread = current;
+	else if (rt != NULL)
+		next_thread = rlist_remove(&rt->sched_node)->tcb;
+
+	if (next_thread != NULL) {
+		next_thread->its = next_thread->rt_budget;
+		return next_thread;
+	}
+
+	TimerDuration left = NO_TIMEOUT;
+	int current_ok = (current->state == READY && current->type != IDLE_THREAD
+		&& !current->rt && (current->affinity & (1u << core->id))
+		&& sched_quota_check(current->owner_pcb, now, &left) == 0);
+
+	/* A thread whose process is out of quota is parked, and we select again */
+	while (1) {
+		next_thread = sched_normal_select(core, current_ok ? current : NULL, now);
+		if (next_thread == current || next_thread->type == IDLE_THREAD)
+			break;
+		TimerDuration until = sched_quota_check(next_thread->owner_pcb, now, &left);
+		if (until == 0)
+			break;
+		sched_quota_park(core, next_thread, until);
+	}
+
+	/* The time-slice does not exceed the budget left */
+	if (next_thread->type != IDLE_THREAD && left < next_thread->its)
+		next_thread->its = left;
+
+	return next_thread;
+}
+
+/*
+  Return the next normal thread to run at the core, or the idle thread: 
+  the current thread (if not NULL) or a queued thread of the gang that 
+  holds the gang slot, or else the choice of the policy, or a thread stolen
+  from another core.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_normal_select(CCB* core, TCB* current, TimerDuration now)
+{
+	/* While a gang holds the slot, its threads come first */
+	TCB* next_thread = sched_gang_select(core, current, now);
+	if (next_thread != NULL)
+		return next_thread;
+
+	next_thread = sched_ops->pick_next(core, current, now);
+	if (next_thread != NULL && next_thread != current)
+		sched_queue_remove(core, next_thread);
+
+	/* Else, we look for work at the other cores, before going idle */
+	if (next_thread == NULL)
+		next_thread = sched_steal(core, now);
+
+	if (next_thread == NULL)
+		next_thread = &core->idle_thread;
+
+	/* A thread preempted before the end of its time-slice (e.g., by the alarm
+	   of a timeout) and chosen again resumes its time-slice */
+	if (next_thread == current && current->curr_cause == SCHED_PREEMPT && current->rts > 0)
+		next_thread->its = current->rts;
+	else
+		next_thread->its = (next_thread->type != IDLE_THREAD && sched_ops->quantum != NULL)
+			? sched_ops->quantum(core, next_thread) : QUANTUM;
+
+	/* A thread of a process in gang mode brings along the rest of its gang */
+	if (next_thread->type != IDLE_THREAD && next_thread->owner_pcb->gang)
+		sched_gang_start(core, next_thread, now);
+
+	return next_thread;
+}
+
+/*
+  Move a thread that is not running (CTX_CLEAN) from its core to another
+  core. A queued thread is queued at the new core, and a sleeping thread 
+  with a timeout moves to the timer wheel of the new core.
+
+  *** MUST BE CALLED WITH BOTH SPINLOCKS HELD ***
+*/
+static void sched_migrate(CCB* from, CCB* to, TCB* tcb)
+{
+	assert(tcb->phase == CTX_CLEAN && tcb->core == from->id);
+
+	if (sched_is_queued(tcb))
+		sched_queue_remove(from, tcb);
+	else if (tcb->wakeup_time != NO_TIMEOUT)
+		rlist_remove(&tcb->sched_node);
+
+	if (sched_ops->on_migrate != NULL)
+		sched_ops->on_migrate(from, to, tcb);
+	__atomic_store_n(&tcb->core, to->id, __ATOMIC_RELEASE);
+	to->migrations++;
+	trace_event(TRACE_MIGRATE, tcb, NULL, from->id);
+
+	if (tcb->state == READY)
+		sched_queue_add(to, tcb);
+	else if (tcb->wakeup_time != NO_TIMEOUT)
+		timer_wheel_insert(&to->timeouts, tcb);
+}
+
+/*
+  Return true if the thread is not running and it is not switching
+  context, so that it may be moved to another core.
+
+  *** MUST BE CALLED WITH THE SPINLOCK OF THE THREAD'S CORE HELD ***
+*/
+static inline int sched_is_parked(TCB* tcb)
+{
+	return tcb->phase == CTX_CLEAN && tcb->state != RUNNING && tcb->state != EXITED;
+}
+
+/*
+  If a thread that is not running is at a core outside its affinity,
+  move it to an allowed core. The two cores are locked in the order 
+  of their ids, so that this cannot deadlock with another such move.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF AND NO SPINLOCK HELD ***
+*/
+static void sched_enforce_affinity(TCB* tcb)
+{
+	while (1) {
+		CCB* from = sched_lock_thread(tcb);
+		if ((sched_allowed(tcb) & (1u << from->id)) || !sched_is_parked(tcb)) {
+			spin_unlock(&from->sched_spinlock);
+			return;
+		}
+
+		CCB* to = &cctx[sched_affine_core(sched_allowed(tcb))];
+		if (to->id < from->id) {
+			spin_unlock(&from->sched_spinlock);
+			spin_lock(&to->sched_spinlock);
+			spin_lock(&from->sched_spinlock);
+			if (tcb->core != from->id) {
+				/* It moved while unlocked, start over */
+				spin_unlock(&from->sched_spinlock);
+				spin_unlock(&to->sched_spinlock);
+				continue;
+			}
+		} else
+			spin_lock(&to->sched_spinlock);
+
+		if (!(sched_allowed(tcb) & (1u << from->id)) && sched_is_parked(tcb))
+			sched_migrate(from, to, tcb);
+
+		spin_unlock(&from->sched_spinlock);
+		spin_unlock(&to->sched_spinlock);
+		return;
+	}
+}
+
+/*
+  Make the process ready.
+
+  When a thread wakes up another, it is likely to block soon after, e.g., 
+  waiting for a reply. Therefore, the woken thread is recorded as the handoff 
+  thread of the waker's core, but it stays queued at its own core. If the 
+  waker does block while the handoff thread is still queued, yield() moves 
+  it over and switches to it directly (see sched_handoff_take()). Otherwise,
+  e.g., when a thread wakes up many others and goes on, they stay where they
+  were. A thread whose own core is idle is not recorded, since it is about 
+  to run there, where its cache is.
+ */
+int wakeup(TCB* tcb)
+{
+	int ret = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = sched_lock_thread(tcb);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		CCB* here = &CURCORE;
+		TCB* waker = here->current_thread; /* NULL while booting */
+		int core_idle = (__atomic_load_n(&idle_cores, __ATOMIC_RELAXED) & (1u << core->id)) != 0;
+
+		sched_make_ready(core, tcb);
+		ret = 1;
+
+		if (waker != NULL && waker->type != IDLE_THREAD && !tcb->rt && !core_idle
+			&& sched_is_queued(tcb) && !tcb->throttled
+			&& (tcb->affinity & (1u << here->id))) {
+			/* Only this core sets its handoff, and it does so with preemption off */
+			here->handoff_core = core->id;
+			__atomic_store_n(&here->handoff, tcb, __ATOMIC_RELAXED);
+			tcb->handoff_waker = here;
+		}
+		trace_event(TRACE_WAKEUP, tcb, waker, 0);
+	}
+
+	spin_unlock(&core->sched_spinlock);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  Make many threads ready. The threads are grouped by core, so that each 
+  core is locked once. Since a thread only changes core while its core is 
+  locked, a thread found at the locked core stays there.
+*/
+int wakeup_many(TCB* tcbs[], int n)
+{
+	if (n <= 0)
+		return 0;
+
+	int woken = 0;
+	char done[n];
+	memset(done, 0, n);
+
+	int oldpre = preempt_off;
+
+	for (int i = 0; i < n; i++) {
+		if (done[i])
+			continue;
+
+		CCB* core = sched_lock_thread(tcbs[i]);
+		for (int j = i; j < n; j++) {
+			TCB* tcb = tcbs[j];
+			if (done[j] || tcb->core != core->id)
+				continue;
+			done[j] = 1;
+			if (tcb->state == STOPPED || tcb->state == INIT) {
+				sched_make_ready(core, tcb);
+				trace_event(TRACE_WAKEUP, tcb, CURCORE.current_thread, 0);
+				woken++;
+			} else
+				tcbs[j] = NULL;
+		}
+		spin_unlock(&core->sched_spinlock);
+	}
+
+	if (oldpre)
+		preempt_on;
+
+	return woken;
+}
+
+/*
+  Atomically put the current process to sleep, after unlocking mx.
+ */
+void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	assert(state == STOPPED || state == EXITED);
+
+
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+	TCB* tcb = core->current_thread;
+	spin_lock(&core->sched_spinlock);
+
+	/* mark the thread as stopped or exited */
+	tcb->state = state;
+	trace_event(TRACE_BLOCK, tcb, NULL, cause);
+
+	/* register the timeout (if any) for the sleeping thread */
+	if (state != EXITED)
+		sched_register_timeout(core, tcb, timeout);
+
+	/* Release the schduler spinlock before calling yield() !!! */
+	spin_unlock(&core->sched_spinlock);
+
+	/* Release mx. This may wake up threads blocked on it, which needs the
+	   scheduler spinlocks. A waker that gets mx now finds the thread stopped,
+	   as it would once the spinlock is released. */
+	if (mx != NULL)
+		Mutex_Unlock(mx);
+
+	/* call this to schedule someone else */
+	yield(cause);
+
+	/* Restore preemption state */
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  Take the handoff thread of the core out of the ready queues, moving it
+  to this core if needed, and return it; or return NULL if there is none,
+  or it cannot run here now, e.g., because its process is out of CPU quota.
+  Then, *left is the quota budget left to it. As in sched_steal(), the core
+  of the handoff thread is only tried, since we hold our own lock. Once it
+  is locked, a non-NULL handoff is still queued there (see
+  sched_handoff_cancel()).
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_handoff_take(CCB* core, TimerDuration now, TimerDuration* left)
+{
+	if (__atomic_load_n(&core->handoff, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+
+	CCB* from = &cctx[core->handoff_core];
+	if (from != core && !sched_trylock(&from->sched_spinlock))
+		return NULL;
+
+	TCB* tcb = __atomic_exchange_n(&core->handoff, NULL, __ATOMIC_RELAXED);
+	if (tcb != NULL && (tcb->throttled || !(sched_allowed(tcb) & (1u << core->id))
+		|| sched_quota_check(tcb->owner_pcb, now, left) != 0))
+		tcb = NULL;
+
+	/* The thread goes straight from the queues of its core to ours, it is
+	   not queued here, and no other core is woken up for it */
+	if (tcb != NULL) {
+		sched_queue_remove(from, tcb);
+		if (from != core) {
+			if (sched_ops->on_migrate != NULL)
+				sched_ops->on_migrate(from, core, tcb);
+			__atomic_store_n(&tcb->core, core->id, __ATOMIC_RELEASE);
+			core->migrations++;
+			trace_event(TRACE_MIGRATE, tcb, NULL, from->id);
+		}
+	}
+
+	if (from != core)
+		spin_unlock(&from->sched_spinlock);
+	return tcb;
+}
+
+/* This function is the entry point to the scheduler's context switching */
+
+void yield(enum SCHED_CAUSE cause)
+{
+	/* Reset the timer, so that we are not interrupted by ALARM */
+	TimerDuration remaining = bios_cancel_timer();
+
+	/* We must stop preemption but save it! */
+	int preempt = preempt_off;
+
+	CCB* core = &CURCORE; /* Make a local copy of the current core, for speed */
+	TCB* current = core->current_thread; /* Make a local copy of current process, for speed */
+
+	spin_lock(&core->sched_spinlock);
+
+	/* The alarm may have been set before the end of the time-slice */
+	remaining += core->alarm_rest;
+	core->alarm_rest = 0;
+
+	/* Update CURTHREAD state */
+	if (current->state == RUNNING)
+		current->state = READY;
+
+	/* Update CURTHREAD scheduler data */
+	current->rts = remaining;
+	current->last_cause = current->curr_cause;
+	current->curr_cause = cause;
+
+	/* Wake up threads whose sleep timeout has expired */
+	sched_wakeup_expired_timeouts(core);
+
+	/* Give a new period to real-time threads whose budget is replenished */
+	TimerDuration now = bios_clock();
+	sched_rt_replenish(core, now);
+	sched_quota_release(core, now);
+
+	/* Periodic work of the policy, e.g., aging */
+	if (sched_ops->on_tick != NULL)
+		sched_ops->on_tick(core, now);
+
+	/* Charge a real-time thread for its time-slice. Other threads are 
+	   accounted by the policy, depending on the reason the yield was caused */
+	TimerDuration used = (current->its > remaining) ? current->its - remaining : 0;
+	if (current->rt)
+		current->rt_budget = (used < current->rt_budget) ? current->rt_budget - used : 0;
+	else {
+		if (sched_ops->on_yield != NULL)
+			sched_ops->on_yield(core, current, cause, used);
+		if (current->type != IDLE_THREAD)
+			sched_quota_charge(current->owner_pcb, used);
+	}
 
-	/* Get next */
-	TCB* next = sched_queue_select(current);
+	/* Get next. If the current thread blocks right after waking up another
+	   thread, the latter gets the rest of our timeslice. */
+	TCB* next = NULL;
+	TimerDuration left = NO_TIMEOUT;
+	if (current->state != READY && remaining > 0 && !current->rt && is_rlist_empty(&core->rt_queue))
+		next = sched_handoff_take(core, now, &left);
+	__atomic_store_n(&core->handoff, NULL, __ATOMIC_RELAXED);
+	if (next != NULL) {
+		next->its = (remaining < left) ? remaining : left;
+		core->handoffs++;
+	} else
+		next = sched_queue_select(core, current, now);
 	assert(next != NULL);
 
+	/* The chosen thread is no longer queued, even before it runs (see sched_is_queued) */
+	next->phase = CTX_DIRTY;
+
+	/* Remember where and when we left, for cache affinity, and account the
+	   run of the current thread. It is an involuntary switch if the thread 
+	   could go on. */
+	if (next != current) {
+		current->last_core = core->id;
+		current->last_run = now;
+		trace_event(TRACE_SWITCH, next, current, cause);
+
+		if (current->type != IDLE_THREAD) {
+			TimerDuration stamp = bios_precise_clock();
+			current->usage.cpu_time += stamp - current->usage_stamp;
+			current->usage_stamp = stamp;
+			if (current->state == READY)
+				current->usage.involuntary++;
+			else
+				current->usage.voluntary++;
+		}
+	}
+
+	/* We have just chosen the best thread, a pending preemption is moot */
+	core->need_resched = 0;
+
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	core->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	spin_unlock(&core->sched_spinlock);
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -488,6 +2237,38 @@ void yield(enum SCHED_CAUSE cause)
 	gain(preempt);
 }
 
+/* The time of the next visit to a timer wheel, or NO_TIMEOUT if it is empty */
+static inline TimerDuration sched_next_timeout(CCB* core)
+{
+	TimerDuration tick = timer_wheel_next_tick(&core->timeouts);
+	return (tick == NO_TIMEOUT) ? NO_TIMEOUT : tick * TIMER_WHEEL_TICK;
+}
+
+/*
+  Return the time of the next scheduling event of the core: the earliest
+  replenishment of a throttled real-time thread, quota period end, or
+  timeout. Return NO_TIMEOUT if there is none.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TimerDuration sched_next_event(CCB* core)
+{
+	TimerDuration event = NO_TIMEOUT;
+
+	if (!is_rlist_empty(&core->rt_throttled))
+		event = core->rt_throttled.next->tcb->rt_release;
+
+	if (!is_rlist_empty(&core->quota_throttled) 
+		&& core->quota_throttled.next->tcb->throttled < event)
+		event = core->quota_throttled.next->tcb->throttled;
+
+	TimerDuration timeout = sched_next_timeout(core);
+	if (timeout < event)
+		event = timeout;
+
+	return event;
+}
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield().
@@ -498,13 +2279,17 @@ void yield(enum SCHED_CAUSE cause)
   in the new timeslice. When returning to threads in the non-preemptive
   domain (e.g., waiting at some driver), we need to not turn preemption
   on!
+
+  Note that we may now be running on a different core than the one
+  we were switched out from.
 */
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	spin_lock(&core->sched_spinlock);
 
-	TCB* current = CURTHREAD;
+	TCB* current = core->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
@@ -512,15 +2297,40 @@ void gain(int preempt)
 	current->rts = current->its;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
+	TCB* misplaced = NULL;
+
+	/* The wakeup latency, from sched_make_ready() until now. The current
+	   thread may have been woken before it switched out, and resumed. */
+	if (current->ready_stamp != NO_TIMEOUT) {
+		TimerDuration delay = bios_precise_clock() - current->ready_stamp;
+		core->latency[current->curr_cause][loghist_bucket(delay)]++;
+		current->ready_stamp = NO_TIMEOUT;
+	}
+
 	if (current != prev) {
+		/* The wait of the current thread is over */
+		if (current->type != IDLE_THREAD) {
+			TimerDuration stamp = bios_precise_clock();
+			current->usage.wait_time += stamp - current->usage_stamp;
+			current->usage_stamp = stamp;
+		}
+
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+			if (prev->type == IDLE_THREAD)
+				break;
+			/* A ready and clean thread must be queued, even if it may not
+			   run here; it is moved to an allowed core right after */
+			sched_queue_add(core, prev);
+			if (!(sched_allowed(prev) & (1u << core->id)))
+				misplaced = prev;
 			break;
 		case EXITED:
+			if (prev->rt)
+				__atomic_fetch_sub(&cctx[prev->rt_core].rt_util,
+					rt_utilization(prev->rt_runtime, prev->rt_period), __ATOMIC_RELAXED);
 			release_TCB(prev);
 			break;
 		case STOPPED:
@@ -530,14 +2340,85 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* The alarm must not be later than the next timeout or replenishment of
+	   the core, so that sleeping and throttled threads are not delayed by a
+	   long time-slice. The rest of the slice is kept in alarm_rest. */
+	TimerDuration slice = current->rts;
+	core->alarm_rest = 0;
+	if (current->type != IDLE_THREAD) {
+		TimerDuration event = sched_next_event(core);
+		TimerDuration now = bios_clock();
+		TimerDuration delta = (event > now) ? event - now : 1;
+		if (event != NO_TIMEOUT && delta < slice) {
+			core->alarm_rest = slice - delta;
+			slice = delta;
+		}
+	}
+
+	spin_unlock(&core->sched_spinlock);
+
+	/* The previous thread may not run here any more, move it */
+	if (misplaced != NULL)
+		sched_enforce_affinity(misplaced);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set a 1-quantum alarm. The idle thread needs none, it halts until
+	   it is woken up. */
+	if (current->type != IDLE_THREAD)
+		bios_set_timer(slice);
+}
+
+/*
+  Check whether the idle thread of a core may halt. Return 0 if there is
+  something to run, either at this core or at another core (to steal).
+  Else, return 1 and store in *deadline the time of the earliest event at
+  this core, or of the earliest timeout at any core, or HALT_FOREVER.
+
+  A sleeping thread is in the timer wheel of the core it slept on, which
+  may be busy. So, the due timeouts of the other cores are expired here,
+  and the threads woken up may be stolen at once.
+*/
+static int sched_may_halt(CCB* core, TimerDuration* deadline)
+{
+	TimerDuration now = bios_clock();
+	TimerDuration event = NO_TIMEOUT;
+
+	if (sched_peek_queued(core))
+		return 0;
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* victim = &cctx[c];
+		if (victim == core)
+			continue;
+
+		spin_lock(&victim->sched_spinlock);
+		sched_wakeup_expired_timeouts(victim);
+
+		/* An idle core wakes up for its own timeouts */
+		TimerDuration timeout = sched_next_timeout(victim);
+		if (timeout < event && !(__atomic_load_n(&idle_cores, __ATOMIC_RELAXED) & (1u << c)))
+			event = timeout;
+
+		/* Threads queued elsewhere matter only if we may steal them */
+		TCB* tcb = sched_peek_queued(victim)
+			? sched_ops->find_stealable(victim, 1u << core->id, now) : NULL;
+		spin_unlock(&victim->sched_spinlock);
+		if (tcb != NULL)
+			return 0;
+	}
+
+	spin_lock(&core->sched_spinlock);
+	TimerDuration own = sched_next_event(core);
+	if (own < event)
+		event = own;
+	int ready = !is_rlist_empty(&core->rt_queue);
+	spin_unlock(&core->sched_spinlock);
+
+	*deadline = (event == NO_TIMEOUT) ? HALT_FOREVER : event;
+	return !ready;
 }
 
 static void idle_thread()
@@ -546,25 +2427,227 @@ static void idle_thread()
 	yield(SCHED_IDLE);
 
 	/* We come here whenever we cannot find a ready thread for our core */
+	CCB* core = &CURCORE;
+	uint32_t cmask = 1u << core->id;
+
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* Interrupts stay off until we halt, so that a wakeup is not lost */
+		int preempt = preempt_off;
+
+		__atomic_fetch_or(&idle_cores, cmask, __ATOMIC_SEQ_CST);
+
+		TimerDuration deadline;
+		if (__atomic_load_n(&active_threads, __ATOMIC_SEQ_CST) > 0 && sched_may_halt(core, &deadline))
+			cpu_core_halt_until(deadline);
+
+		__atomic_fetch_and(&idle_cores, ~cmask, __ATOMIC_SEQ_CST);
+
+		if (preempt)
+			preempt_on;
 		yield(SCHED_IDLE);
 	}
 
 	/* If the idle thread exits here, we are leaving the scheduler! */
 	bios_cancel_timer();
-	cpu_core_restart_all();
+
+	/* Wake up all halted cores, so that they exit too */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint32_t idle = __atomic_exchange_n(&idle_cores, 0, __ATOMIC_SEQ_CST);
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (idle & (1u << c))
+			cpu_ici(c);
 }
 
 /*
-  Initialize the scheduler queue
- */
-void initialize_scheduler()
+  Multi-level feedback queues.
+
+  A thread is queued at the level of its priority. It is demoted when it 
+  uses up its quantum, promoted when it blocks for I/O, and promoted by 
+  aging when it waits too long (see sched_age_queues()).
+*/
+
+static void mlfq_enqueue(CCB* core, TCB* tcb)
+{
+	sched_queue_push(core, mlfq_level(tcb), tcb, bios_clock());
+
+	/* A long time-slice is for batch work, it does not delay a better thread.
+	   This looks at the length of the time-slice, not at the time used of it */
+	TCB* cur = core->current_thread;
+	if (cur != NULL && cur->type != IDLE_THREAD && !cur->rt && cur->its > QUANTUM
+		&& mlfq_level(tcb) < mlfq_level(cur)) {
+		core->need_resched = 1;
+		cpu_ici(core->id);
+	}
+}
+
+static void mlfq_dequeue(CCB* core, TCB* tcb)
+{
+	sched_queue_unlink(core, mlfq_level(tcb), tcb);
+}
+
+/* The lowest set bit of the bitmap is the best non-empty queue */
+static TCB* mlfq_pick_next(CCB* core, TCB* current, TimerDuration now)
+{
+	if (core->queue_bitmap) {
+		int prio = __builtin_ctz(core->queue_bitmap);
+		return sched_pick_warm(core, prio, now);
+	}
+
+	/* If no threads are waiting we attempt to execute the current thread again */
+	return current;
+}
+
+/* Adapt the priority, depending on the reason the yield was caused */
+static void mlfq_on_yield(CCB* core, TCB* current, enum SCHED_CAUSE cause, TimerDuration used)
 {
-    for (int i = 0; i<QUEUE_AMOUNT; i++){
-        rlnode_init(&SCHED[i], NULL);
+	switch(cause){
+        case SCHED_QUANTUM:
+            change_priority(current, 0);
+            break;
+        case SCHED_IO:
+            change_priority(current, 1);
+            break;
+        case SCHED_MUTEX:
+            if (current->last_cause == current->curr_cause)
+                change_priority(current, 0);
+            break;
+        default:
+            break;
     }
-	rlnode_init(&TIMEOUT_LIST, NULL);
+}
+
+/*
+  The time-slice of a level: short at the top, where interactive threads
+  are, and long at the bottom, where CPU-bound threads sink. It starts at
+  QUANTUM/2 and doubles every two levels, up to MLFQ_MAX_QUANTUM.
+*/
+static inline TimerDuration mlfq_quantum(int level)
+{
+	TimerDuration q = QUANTUM / 2;
+	for (int l = level / 2; l > 0 && q < MLFQ_MAX_QUANTUM; l--)
+		q *= 2;
+	return (q < MLFQ_MAX_QUANTUM) ? q : MLFQ_MAX_QUANTUM;
+}
+
+/* A thread that used up its last two time-slices is CPU-bound, and gets a longer one */
+static TimerDuration mlfq_get_quantum(CCB* core, TCB* tcb)
+{
+	TimerDuration q = mlfq_quantum(mlfq_level(tcb));
+	if (tcb->curr_cause == SCHED_QUANTUM && tcb->last_cause == SCHED_QUANTUM)
+		q = (2 * q < MLFQ_MAX_QUANTUM) ? 2 * q : MLFQ_MAX_QUANTUM;
+	return q;
+}
+
+/*
+  Round-robin.
+
+  All threads share the top-level queue of the core, in FIFO order.
+*/
+
+static void rr_enqueue(CCB* core, TCB* tcb)
+{
+	sched_queue_push(core, 0, tcb, bios_clock());
+}
+
+static void rr_dequeue(CCB* core, TCB* tcb)
+{
+	sched_queue_unlink(core, 0, tcb);
+}
+
+static TCB* rr_pick_next(CCB* core, TCB* current, TimerDuration now)
+{
+	return core->queue_bitmap ? core->sched_queue[0].next->tcb : current;
+}
+
+/* The policies, indexed by sched_policy */
+static const sched_policy_ops sched_policies[] = {
+	[SCHED_POLICY_MLFQ] = {
+		.name = "mlfq",
+		.enqueue = mlfq_enqueue,
+		.dequeue = mlfq_dequeue,
+		.pick_next = mlfq_pick_next,
+		.on_yield = mlfq_on_yield,
+		.on_tick = sched_age_queues,
+		.find_stealable = mlfq_find_stealable,
+		.quantum = mlfq_get_quantum
+	},
+	[SCHED_POLICY_RR] = {
+		.name = "rr",
+		.enqueue = rr_enqueue,
+		.dequeue = rr_dequeue,
+		.pick_next = rr_pick_next,
+		.find_stealable = mlfq_find_stealable
+	},
+	[SCHED_POLICY_FAIR] = {
+		.name = "fair",
+		.enqueue = fair_enqueue,
+		.dequeue = fair_dequeue,
+		.pick_next = fair_pick_next,
+		.on_yield = fair_on_yield,
+		.on_wakeup = fair_on_wakeup,
+		.find_stealable = fair_find_stealable
+	}
+};
+
+/*
+  Initialize the scheduler queues of all cores
+ */
+void initialize_scheduler(sched_policy policy)
+{
+	assert(policy < sizeof(sched_policies) / sizeof(sched_policies[0]));
+	sched_ops = &sched_policies[policy];
+
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->id = c;
+		core->sched_spinlock = MUTEX_INIT;
+	    for (int i = 0; i<QUEUE_AMOUNT; i++){
+	        rlnode_init(&core->sched_queue[i], NULL);
+	    }
+		core->queue_bitmap = 0;
+		timer_wheel_init(&core->timeouts, bios_clock());
+		core->last_aging = 0;
+		core->handoff = NULL;
+		core->queued = 0;
+		core->fair_tree = NULL;
+		for (int b = 0; b < FAIR_GROUP_BUCKETS; b++)
+			core->fair_groups[b] = NULL;
+		core->min_vruntime = 0;
+		rlnode_init(&core->rt_queue, NULL);
+		rlnode_init(&core->rt_throttled, NULL);
+		rlnode_init(&core->quota_throttled, NULL);
+		core->rt_util = 0;
+		core->need_resched = 0;
+		core->alarm_rest = 0;
+		core->migrations = 0;
+		core->steals = 0;
+		core->handoffs = 0;
+		core->gang_dispatches = 0;
+		core->threads_reused = 0;
+		memset(core->latency, 0, sizeof(core->latency));
+		/* The thread cache is kept from the previous boot */
+	}
+
+	/* The thread memory mode; the kept blocks of another mode are freed */
+	const char* mem = getenv("TINYOS_THREAD_MEM");
+	int mode = (mem != NULL && strcmp(mem, "mmap") == 0) ? THREAD_MEM_MMAP : THREAD_MEM_MALLOC;
+	if (mode != thread_mem) {
+		thread_cache_flush();
+		thread_mem = mode;
+		thread_guard = (mode == THREAD_MEM_MMAP) ? SYSTEM_PAGE_SIZE : 0;
+	}
+
+	const char* pool = getenv("TINYOS_THREAD_POOL");
+	thread_pool_cap = (pool != NULL) ? strtoul(pool, NULL, 0) : THREAD_POOL_SIZE;
+
+	/* Stack accounting starts afresh */
+	const char* stack = getenv("TINYOS_STACK");
+	if (stack == NULL || *stack == '\0')
+		stack_mode = STACK_OFF;
+	else
+		stack_mode = (strcmp(stack, "auto") == 0 && thread_mem == THREAD_MEM_MMAP)
+			? STACK_AUTO : STACK_REPORT;
+	memset(stack_table, 0, sizeof(stack_table));
 }
 
 void run_scheduler()
@@ -581,7 +2664,9 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.ready_stamp = NO_TIMEOUT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
+	curcore->idle_thread.core = cpu_core_id;
 
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
@@ -589,6 +2674,12 @@ void run_scheduler()
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
+	/* The idle thread is not made by spawn_thread(), so it must be given
+	   no inherited priority here. Else, when it releases a lock, the zero
+	   left in its TCB looks like a priority inherited from a waiter, and
+	   set_inherited_priority() is called to drop it. */
+	curcore->idle_thread.inherited = QUEUE_AMOUNT;
+
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
 	cpu_interrupt_handler(ICI, ici_handler);
@@ -603,8 +2694,313 @@ void run_scheduler()
 	cpu_interrupt_handler(ICI, NULL);
 }
 
+int set_thread_affinity(TCB* tcb, uint32_t mask)
+{
+	/* A real-time thread must stay at the core it was admitted to */
+	if (tcb->rt && !(mask & (1u << tcb->rt_core)))
+		return -1;
+
+	int preempt = preempt_off;
+
+	CCB* core = sched_lock_thread(tcb);
+	tcb->affinity = mask;
+	spin_unlock(&core->sched_spinlock);
+
+	if (tcb == CURTHREAD) {
+		/* We are running at a core we may not use, yield to move */
+		if (!(mask & (1u << core->id)))
+			yield(SCHED_USER);
+	} else
+		sched_enforce_affinity(tcb);
+
+	if (preempt)
+		preempt_on;
+
+	return 0;
+}
+
+int set_thread_realtime(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline)
+{
+	assert(runtime == 0 || (runtime <= deadline && deadline <= period));
+
+	uint64_t old_util = tcb->rt ? rt_utilization(tcb->rt_runtime, tcb->rt_period) : 0;
+	uint64_t util = (runtime > 0) ? rt_utilization(runtime, period) : 0;
+
+	/* Admission control: choose the allowed core with the most spare
+	   utilization (worst fit), that can accommodate the thread. Admissions
+	   are serialized by the kernel lock, so utilization can only drop 
+	   while we look. */
+	uint target = 0;
+	if (runtime > 0) {
+		uint64_t best_spare = 0;
+		int found = 0;
+		for (uint c = 0; c < cpu_cores(); c++) {
+			if (!(tcb->affinity & (1u << c)))
+				continue;
+			uint64_t used = __atomic_load_n(&cctx[c].rt_util, __ATOMIC_RELAXED);
+			if (tcb->rt && tcb->rt_core == c)
+				used -= old_util;
+			if (used + util > RT_UTIL_MAX)
+				continue;
+			if (!found || RT_UTIL_MAX - used - util > best_spare) {
+				best_spare = RT_UTIL_MAX - used - util;
+				target = c;
+				found = 1;
+			}
+		}
+		if (!found)
+			return -1;
+	}
+
+	int preempt = preempt_off;
+
+	CCB* core = sched_lock_thread(tcb);
+
+	/* A queued thread changes queues */
+	int queued = sched_is_queued(tcb);
+	if (queued)
+		sched_queue_remove(core, tcb);
+
+	if (tcb->rt)
+		__atomic_fetch_sub(&cctx[tcb->rt_core].rt_util, old_util, __ATOMIC_RELAXED);
+
+	tcb->rt = (runtime > 0);
+	if (tcb->rt) {
+		tcb->rt_core = target;
+		tcb->rt_runtime = runtime;
+		tcb->rt_period = period;
+		tcb->rt_deadline = deadline;
+		sched_rt_new_period(tcb, bios_clock());
+		__atomic_fetch_add(&cctx[target].rt_util, util, __ATOMIC_RELAXED);
+	}
+
+	/* If the thread must move, sched_enforce_affinity() will queue it */
+	if (queued && (sched_allowed(tcb) & (1u << core->id)))
+		sched_queue_add(core, tcb);
+
+	spin_unlock(&core->sched_spinlock);
+
+	/* Let the current thread be rescheduled (and possibly moved) at once */
+	if (tcb == CURTHREAD)
+		yield(SCHED_USER);
+	else
+		sched_enforce_affinity(tcb);
+
+	if (preempt)
+		preempt_on;
+
+	return 0;
+}
+
+void set_thread_nice(TCB* tcb, int nice)
+{
+	assert(nice >= 0 && nice <= MAX_NICE);
+
+	int preempt = preempt_off;
+	CCB* core = sched_lock_thread(tcb);
+
+	/* A queued thread changes queues */
+	int queued = sched_is_queued(tcb);
+	if (queued)
+		sched_queue_remove(core, tcb);
+
+	tcb->nice = nice;
+	if (tcb->priority < NICE_PRIORITY(nice))
+		tcb->priority = NICE_PRIORITY(nice);
+
+	if (queued)
+		sched_queue_add(core, tcb);
+
+	spin_unlock(&core->sched_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
+int effective_priority(TCB* tcb)
+{
+	if (tcb->rt)
+		return 0;
+	return mlfq_level(tcb);
+}
+
+void set_inherited_priority(TCB* tcb, int level)
+{
+	assert(level >= 0 && level <= QUEUE_AMOUNT);
+
+	int preempt = preempt_off;
+	CCB* core = sched_lock_thread(tcb);
+
+	if (tcb->inherited != level) {
+		/* A queued thread changes queues */
+		int queued = sched_is_queued(tcb);
+		if (queued)
+			sched_queue_remove(core, tcb);
+
+		tcb->inherited = level;
+
+		if (queued)
+			sched_queue_add(core, tcb);
+	}
+
+	spin_unlock(&core->sched_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
+void get_thread_usage(TCB* tcb, cpu_usage* usage)
+{
+	int preempt = preempt_off;
+	CCB* core = sched_lock_thread(tcb);
+
+	*usage = tcb->usage;
+
+	/* Add the current run, or the current wait */
+	TimerDuration elapsed = bios_precise_clock() - tcb->usage_stamp;
+	if (tcb->state == RUNNING)
+		usage->cpu_time += elapsed;
+	else if (tcb->state == READY && tcb->phase == CTX_CLEAN)
+		usage->wait_time += elapsed;
+
+	spin_unlock(&core->sched_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
+int sys_GetSchedStats(sched_stats* stats)
+{
+	if (stats == NULL)
+		return -1;
+
+	stats->migrations = stats->steals = stats->handoffs = stats->gang_dispatches = 0;
+	stats->threads_reused = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		stats->migrations += __atomic_load_n(&cctx[c].migrations, __ATOMIC_RELAXED);
+		stats->steals += __atomic_load_n(&cctx[c].steals, __ATOMIC_RELAXED);
+		stats->handoffs += __atomic_load_n(&cctx[c].handoffs, __ATOMIC_RELAXED);
+		stats->gang_dispatches += __atomic_load_n(&cctx[c].gang_dispatches, __ATOMIC_RELAXED);
+		stats->threads_reused += __atomic_load_n(&cctx[c].threads_reused, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static const char* sched_cause_names[SCHED_CAUSES] = {
+	[SCHED_QUANTUM] = "quantum",
+	[SCHED_IO] = "io",
+	[SCHED_MUTEX] = "mutex",
+	[SCHED_PIPE] = "pipe",
+	[SCHED_POLL] = "poll",
+	[SCHED_IDLE] = "idle",
+	[SCHED_USER] = "user",
+	[SCHED_PREEMPT] = "preempt"
+};
+
+const char* sched_cause_name(int cause)
+{
+	return (cause >= 0 && cause < SCHED_CAUSES) ? sched_cause_names[cause] : "?";
+}
+
+/*
+	Add the latency histograms of the given cores and causes (-1 for all)
+	to 'hist'. The counters are read without locking.
+ */
+static void sched_latency_sum(uint ncores, int core, int cause, unsigned long* hist)
+{
+	for (uint c = 0; c < ncores; c++) {
+		if (core >= 0 && c != (uint) core)
+			continue;
+		for (int k = 0; k < SCHED_CAUSES; k++) {
+			if (cause >= 0 && k != cause)
+				continue;
+			for (uint b = 0; b < LOGHIST_BUCKETS; b++)
+				hist[b] += __atomic_load_n(&cctx[c].latency[k][b], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int sys_GetSchedLatency(int core, int cause, sched_latency* lat)
+{
+	if (lat == NULL || core < -1 || core >= (int) cpu_cores()
+		|| cause < -1 || cause >= SCHED_CAUSES)
+		return -1;
+
+	unsigned long hist[LOGHIST_BUCKETS] = { 0 };
+	sched_latency_sum(cpu_cores(), core, cause, hist);
+
+	lat->count = loghist_count(hist);
+	lat->p50 = loghist_percentile(hist, 50.0);
+	lat->p99 = loghist_percentile(hist, 99.0);
+	lat->p999 = loghist_percentile(hist, 99.9);
+	return 0;
+}
+
+/* A row of the latency report, if the histogram is not empty */
+static void sched_latency_row(FILE* f, const char* core, const char* cause, unsigned long* hist)
+{
+	unsigned long n = loghist_count(hist);
+	if (n > 0)
+		fprintf(f, "%6s %-8s %10lu %10lu %10lu %10lu\n", core, cause, n,
+			(unsigned long) loghist_percentile(hist, 50.0),
+			(unsigned long) loghist_percentile(hist, 99.0),
+			(unsigned long) loghist_percentile(hist, 99.9));
+}
+
+void sched_latency_report(FILE* f)
+{
+	const char* env = getenv("TINYOS_LATENCY");
+	if (env == NULL || *env == '\0')
+		return;
+
+	uint ncores = cpu_cores();
+	fprintf(f, "Wakeup latency (usec)\n%6s %-8s %10s %10s %10s %10s\n",
+		"core", "cause", "count", "p50", "p99", "p99.9");
+	for (int c = -1; c < (int) ncores; c++) {
+		char name[12];
+		if (c < 0)
+			strcpy(name, "all");
+		else
+			snprintf(name, sizeof(name), "%d", c);
+		for (int k = -1; k < SCHED_CAUSES; k++) {
+			unsigned long hist[LOGHIST_BUCKETS] = { 0 };
+			sched_latency_sum(ncores, c, k, hist);
+			sched_latency_row(f, name, (k < 0) ? "all" : sched_cause_name(k), hist);
+		}
+	}
+}
+
+int sys_GetStackUsage(Task task, stack_usage* usage)
+{
+	if (stack_mode == STACK_OFF || usage == NULL || task == NULL)
+		return -1;
+
+	spin_lock(&stack_spinlock);
+	stack_record* r = stack_lookup(task, 0);
+	if (r != NULL) {
+		usage->threads = r->threads;
+		usage->max_used = r->max_used;
+		usage->auto_size = r->auto_size;
+	}
+	spin_unlock(&stack_spinlock);
+	return (r != NULL) ? 0 : -1;
+}
+
+void stack_usage_report(FILE* f)
+{
+	if (stack_mode == STACK_OFF)
+		return;
+
+	fprintf(f, "Stack usage (bytes)\n%-18s %10s %10s %10s %10s\n",
+		"task", "threads", "max used", "stack", "auto size");
+	for (uint i = 0; i < STACK_TASKS; i++) {
+		stack_record* r = &stack_table[i];
+		if (r->task == NULL)
+			continue;
+		fprintf(f, "%-18p %10lu %10zu %10zu %10zu%s\n", (void*) r->task, r->threads,
+			r->max_used, r->max_size, r->auto_size, r->full ? " (full)" : "");
+	}
+}
+
 void change_priority(TCB* tcb, int increase){
-    if (increase == 1 && tcb->priority != 0){
+    if (increase == 1 && tcb->priority > NICE_PRIORITY(tcb->nice)){
         tcb->priority --;
     }else if(increase == 0 && tcb->priority < QUEUE_AMOUNT - 1){
         tcb->priority ++;
@@ -612,17 +3008,3 @@ void change_priority(TCB* tcb, int increase){
     assert(tcb->priority >=0 && tcb->priority <= QUEUE_AMOUNT);
 }
 
-void increase_all_priorities(){
-    for(int i = 1; i < QUEUE_AMOUNT; i++){  /* Iterating through every queue except the highest*/
-        TCB* tcb;
-        do{
-            /* For every lower priority queue, we remove the thread and put it
-             * on the directly more prioritized queue. Its priority is also incremented */
-            tcb = rlist_pop_front(&SCHED[i])->tcb;
-            if(tcb != NULL) {
-                rlist_push_back(&SCHED[i - 1], &tcb->sched_node);
-                change_priority(tcb, 1);
-            }
-        }while(tcb != NULL);
-    }
-}
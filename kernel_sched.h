@@ -83,44 +83,112 @@ typedef enum {
   adjust the dynamic priority of the current thread.
  */
 enum SCHED_CAUSE {
-	SCHED_QUANTUM, /**< @brief The quantum has expired */
-	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
-	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
-	SCHED_POLL, /**< @brief The thread is polling a device */
-	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_QUANTUM = SCHED_CAUSE_QUANTUM, /**< @brief The quantum has expired */
+	SCHED_IO = SCHED_CAUSE_IO, /**< @brief The thread is waiting for I/O */
+	SCHED_MUTEX = SCHED_CAUSE_MUTEX, /**< @brief @c Mutex_Lock blocked or yielded on contention */
+	SCHED_PIPE = SCHED_CAUSE_PIPE, /**< @brief Sleep at a pipe or socket */
+	SCHED_POLL = SCHED_CAUSE_POLL, /**< @brief The thread is polling a device */
+	SCHED_IDLE = SCHED_CAUSE_IDLE, /**< @brief The idle thread called yield */
+	SCHED_USER = SCHED_CAUSE_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT = SCHED_CAUSE_PREEMPT /**< @brief A more urgent thread became ready at this core */
 };
 
+/** @brief The number of scheduler causes */
+#define SCHED_CAUSES (SCHED_PREEMPT + 1)
+
+/** @brief Return the name of a scheduler cause (e.g., "pipe") */
+const char* sched_cause_name(int cause);
+
+/** @brief The size of a cache line (bytes), the unit of sharing between cores. */
+#define CACHE_LINE_SIZE 64
+
 /**
   @brief The thread control block
 
   An object of this type is associated to every thread. In this object
   are stored all the metadata that relate to the thread.
+
+  The fields are laid out by use: the fields of the scheduler come first 
+  (those read when scanning the priority queues fill the first cache line,
+  and the node of the fair run queue starts the second), then, starting at
+  a new cache line, the fields that are rarely used, and last, at its own
+  cache line, the context.
 */
 typedef struct thread_control_block {
 
-	PCB* owner_pcb; /**< @brief This is null for a free TCB */
-	PTCB* ptcb; /**< @brief The connected PTCB */
+	/* Hot part. The first cache line holds the fields read when the priority
+	   queues are scanned (for aging, stealing and picking a warm thread),
+	   the second starts with the fields read when the fair run queue is
+	   walked. A walk of the fair queue also reads the affinity and the last
+	   run of each thread, so it touches both lines. */
 
-    int priority;
-
-	cpu_context_t context; /**< @brief The thread context */
-	Thread_type type; /**< @brief The type of thread */
+	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
 
-	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+    int priority;
+    int inherited; /**< @brief The priority level inherited from the waiters of a lock this thread holds, 
+                        or @c QUEUE_AMOUNT if none (see @c set_inherited_priority()) */
 
-	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	uint32_t affinity; /**< @brief Bit @c c is set iff the thread may run on core @c c.
+
+	  A thread is only queued at a core of its affinity. A running thread whose
+	  affinity excludes its core moves to an allowed core at its next yield.
+	  */
+
+	uint last_core; /**< @brief The core this thread last ran on */
+	TimerDuration last_run; /**< @brief When this thread last left a core, 0 if it never ran */
+	TimerDuration enqueue_time; /**< @brief When the thread entered its current ready queue, used for aging */
+
+	tnode fair_node; /**< @brief Node in the tree of its process at its core (see @c fair_group), keyed by @c vruntime */
+	TimerDuration vruntime; /**< @brief Virtual runtime, used by the fair policy */
+
+	uint core; /**< @brief The core whose scheduler queues this thread belongs to.
+
+	  The state and phase of the thread are protected by the scheduler spinlock of
+	  this core. The value only changes when a thread that is not running moves to 
+	  another core, e.g., when it is stolen. Then, both cores are locked.
+	  */
 
-	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
+	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
+	Thread_type type; /**< @brief The type of thread */
+    int nice; /**< @brief The nice value, see @c SetPriority() */
+	int contended_locks; /**< @brief The number of mutexes held by this thread that other threads are
+	                          blocked on. Their priority is inherited until the last one is unlocked. */
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	PCB* owner_pcb; /**< @brief This is null for a free TCB */
+	PTCB* ptcb; /**< @brief The connected PTCB */
+	TimerDuration throttled; /**< @brief While the thread waits for the quota of its process, the end of
+	                              the quota period, else 0 */
+	CCB* handoff_waker; /**< @brief The core where this thread is recorded as the handoff thread
+	                         (see @c CCB.handoff), or NULL */
+	TimerDuration usage_stamp; /**< @brief When the thread started running, or became ready (precise clock) */
+	TimerDuration ready_stamp; /**< @brief When the thread was made ready, until it runs, else @c NO_TIMEOUT (precise clock) */
+
+	int rt; /**< @brief Non-zero for a real-time (EDF) thread */
+	uint rt_core; /**< @brief The core a real-time thread is admitted to */
+	TimerDuration rt_runtime; /**< @brief Real-time budget per period (usec) */
+	TimerDuration rt_period; /**< @brief Real-time period (usec) */
+	TimerDuration rt_deadline; /**< @brief Real-time relative deadline (usec) */
+	TimerDuration rt_abs_deadline; /**< @brief Absolute deadline of the current period */
+	TimerDuration rt_release; /**< @brief Start of the next period, when the budget is replenished */
+	TimerDuration rt_budget; /**< @brief Runtime left in the current period */
+
+	/* Cold part: fields used when a thread is created, exits, or is inspected */
+
+	_Alignas(CACHE_LINE_SIZE)
+	rlnode gang_node; /**< @brief Node for the @c gang_ready list of the process, while queued in gang mode */
+	cpu_usage usage; /**< @brief CPU usage, not including the current run or wait */
+
+	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+	size_t stack_size; /**< @brief The size of the thread stack */
+	Task task; /**< @brief The task run by the thread, for stack accounting */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -132,33 +200,221 @@ typedef struct thread_control_block {
 	  */
 #endif
 
+	/* The context is only used at a context switch, and is the largest field 
+	   by far, so it is kept apart, at the end. */
+
+	_Alignas(CACHE_LINE_SIZE)
+	cpu_context_t context; /**< @brief The thread context */
+
 } TCB;
 
 /** @brief Thread stack size.
 
-  The default thread stack size in TinyOS is 128 kbytes.
+  The default thread stack size in TinyOS is 128 kbytes. A thread created 
+  by @c CreateThreadEx may have a different size.
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The number of exited thread blocks (TCB and stack) kept by each core for reuse. 
+
+  Only the blocks of threads with the default stack size are kept.
+
+  @see spawn_thread
+ */
+#define THREAD_CACHE_SIZE 16
+
+/** @brief The number of threads of a task measured before its stack is auto-sized.
+
+  @see GetStackUsage
+ */
+#define STACK_AUTO_SAMPLES 8
+
+/** @brief The number of tasks whose stack usage is recorded. */
+#define STACK_TASKS 256
+
+/** @brief The default number of thread blocks kept for reuse by all cores, beyond their caches.
+
+  This can be set at boot by the environment variable @c TINYOS_THREAD_POOL.
+ */
+#define THREAD_POOL_SIZE 256
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief The number of priority levels (and run queues) of the scheduler. */
+#define QUEUE_AMOUNT 10
+
+/** @brief Timer wheel tick (in microseconds) */
+#define TIMER_WHEEL_TICK 1000
+
+/** @brief Log2 of the number of slots per timer wheel level */
+#define TIMER_WHEEL_BITS 6
+
+/** @brief Number of slots per timer wheel level */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+/** @brief Number of timer wheel levels.
+
+  With 1 msec ticks, 4 levels of 64 slots cover about 4.6 hours. Timeouts
+  further in the future are parked at the last slot and re-cascaded.
+ */
+#define TIMER_WHEEL_LEVELS 4
+
+/** @brief A hierarchical timing wheel of sleeping threads.
+
+  Level @c l of the wheel has @c TIMER_WHEEL_SLOTS slots, each spanning 
+  @f$ 64^l @f$ ticks. A thread is placed at the lowest level whose span
+  covers its timeout, so insertion and cancellation are O(1). As time
+  advances, the slots of higher levels are cascaded down to lower ones,
+  and the slots of level 0 are expired.
+
+  The per-level bitmaps mark the non-empty slots. They are cleared lazily,
+  i.e., a cancelled timeout may leave a stale bit, which is cleared when 
+  the slot is visited.
+ */
+typedef struct timer_wheel {
+	TimerDuration now; /**< @brief The next tick to be processed */
+	uint64_t bitmap[TIMER_WHEEL_LEVELS]; /**< @brief Non-empty slots, per level */
+	rlnode slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /**< @brief The slot lists */
+} timer_wheel;
+
+/** @brief Number of buckets of the hash table of the fair groups of a core */
+#define FAIR_GROUP_BUCKETS 16
+
+/** @brief A process with ready threads at a core, under the fair policy.
+
+  The fair tree of a core holds one group for each process with threads in
+  the fair queue of the core, keyed by the virtual runtime of the process.
+  Each group holds these threads in a tree of its own, keyed by their virtual
+  runtime. A group exists while it holds threads.
+ */
+typedef struct fair_group {
+	tnode node; /**< @brief Node in the fair tree of the core */
+	tnode* threads; /**< @brief The ready threads of the process at the core, by virtual runtime */
+	PCB* pcb; /**< @brief The process */
+	uint boosted; /**< @brief The number of the threads with inherited priority */
+	struct fair_group* next; /**< @brief The next group of the same bucket, or of the free list */
+} fair_group;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a set of run queues, one per priority level, and a timer wheel of 
+  its sleeping threads that have a timeout. These, together with the state of every 
+  thread whose @c core field designates this core, are protected by @c sched_spinlock.
+
+  The fields are grouped by who writes them, each group starting at a new cache 
+  line, and every CCB is cache-line aligned, so that cores do not false-share: 
+  the fields used only by this core, then the fields protected by 
+  @c sched_spinlock (which other cores also lock, e.g., to steal threads), 
+  and then the statistics.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
 
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
+	TimerDuration alarm_rest; /**< @brief The part of the current time-slice beyond the pending alarm */
+
+	void* thread_cache; /**< @brief Memory blocks of exited threads, for reuse (only used by this core) */
+	uint thread_cached; /**< @brief The number of blocks in @c thread_cache */
+
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	_Alignas(CACHE_LINE_SIZE)
+	Mutex sched_spinlock; /**< @brief Spinlock for the queues of this core */
+	uint32_t queue_bitmap; /**< @brief Bit @c i is set iff @c sched_queue[i] is non-empty */
+	uint queued; /**< @brief The number of normal threads in the queues of the scheduling policy */
+	int need_resched; /**< @brief Set when the current thread should be preempted */
+	TCB* handoff; /**< @brief A ready thread woken by the current thread, to switch to if the 
+	                   current thread blocks, or NULL. It is cleared (atomically) when the thread 
+	                   leaves the queues of its core. */
+	uint handoff_core; /**< @brief The core whose queues hold @c handoff */
+	tnode* fair_tree; /**< @brief The processes with ready threads of the fair policy, by virtual runtime */
+	fair_group* fair_groups[FAIR_GROUP_BUCKETS]; /**< @brief The groups of @c fair_tree, hashed by process id */
+	fair_group* fair_free; /**< @brief Unused groups, kept for reuse */
+	TimerDuration min_vruntime; /**< @brief Monotonic lower bound of the virtual runtime of the core's processes */
+	TimerDuration last_aging; /**< @brief The clock value at the last aging pass */
+	uint64_t rt_util; /**< @brief Utilization reserved by real-time threads (@c RT_UTIL_ONE is 100%) */
+	rlnode sched_queue[QUEUE_AMOUNT]; /**< @brief The ready queues, one per priority level */
+	rlnode rt_queue; /**< @brief Ready real-time threads, by absolute deadline */
+	rlnode rt_throttled; /**< @brief Real-time threads out of budget, by replenishment time */
+	rlnode quota_throttled; /**< @brief Ready threads whose process is out of CPU quota, by end of period */
+	timer_wheel timeouts; /**< @brief Sleeping threads of this core with a timeout */
+
+	_Alignas(CACHE_LINE_SIZE)
+	unsigned long migrations; /**< @brief Threads moved to this core from another core */
+	unsigned long steals; /**< @brief Threads stolen by this core (included in @c migrations) */
+	unsigned long handoffs; /**< @brief Direct switches to a woken thread */
+	unsigned long gang_dispatches; /**< @brief Threads dispatched here to run with their gang */
+	unsigned long threads_reused; /**< @brief Threads created here with the memory of an exited thread */
+
+	/** @brief Wakeup latency histograms, by the cause the thread had stopped for.
+
+	  The time (usec) from when a thread is made ready, until it runs at this core.
+	  @see loghist
+	  */
+	unsigned long latency[SCHED_CAUSES][LOGHIST_BUCKETS];
+
 } CCB;
 
+/**
+  @brief The operations of a scheduling policy.
+
+  Real-time threads are scheduled by EDF, ahead of all other threads. The 
+  other (normal) threads are scheduled by a policy, chosen at boot. A policy
+  keeps the ready normal threads of each core in its own queues in the CCB. 
+  All methods are called with the spinlock of the core held. The methods
+  marked optional may be NULL.
+
+  @see sched_policy
+*/
+typedef struct sched_policy_ops {
+	const char* name; /**< @brief The name of the policy */
+
+	/** @brief Add a ready thread to the queues of the core. */
+	void (*enqueue)(CCB* core, TCB* tcb);
+
+	/** @brief Remove a queued thread from the queues of the core. */
+	void (*dequeue)(CCB* core, TCB* tcb);
+
+	/** @brief Choose the next thread to run at the core.
+
+	  Return a queued thread, or @c current to keep running it, or NULL if
+	  there is nothing to run. The argument @c current is NULL if the current
+	  thread cannot go on (e.g., it blocked).
+	  */
+	TCB* (*pick_next)(CCB* core, TCB* current, TimerDuration now);
+
+	/** @brief Account a time-slice of @c used usec of the current thread,
+	  which ended because of @c cause (optional). */
+	void (*on_yield)(CCB* core, TCB* current, enum SCHED_CAUSE cause, TimerDuration used);
+
+	/** @brief Periodic work, done at every invocation of the scheduler (optional). */
+	void (*on_tick)(CCB* core, TimerDuration now);
+
+	/** @brief A new or stopped thread of the core becomes ready; it is queued
+	  right after this call, if it is not running (optional). */
+	void (*on_wakeup)(CCB* core, TCB* tcb);
+
+	/** @brief A thread that is not queued moves from core @c from to core @c to (optional). */
+	void (*on_migrate)(CCB* from, CCB* to, TCB* tcb);
+
+	/** @brief Return a queued thread of @c victim that may run at a core of
+	  @c cmask, preferably one the victim would run last, or NULL. */
+	TCB* (*find_stealable)(CCB* victim, uint32_t cmask, TimerDuration now);
+
+	/** @brief Return the time-slice of a thread about to run at the core 
+	  (optional, the default is @c QUANTUM). */
+	TimerDuration (*quantum)(CCB* core, TCB* tcb);
+
+} sched_policy_ops;
+
+
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
@@ -202,15 +458,21 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param task The task of the new thread, used to account its stack usage.
+    @param stack_size The size of the stack of the new thread, or 0 for 
+                the default (@c THREAD_STACK_SIZE, or less if auto-sized for 
+                @c task). It is rounded up to a multiple of the page size.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), Task task, size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
 
   This call will change the state of a thread from @c STOPPED or @c INIT (where the
-  thread is blocked) to @c READY. 
+  thread is blocked) to @c READY. The thread stays at its core, but if the
+  caller blocks soon after, the thread may be moved to the caller's core and
+  run next.
 
   @param tcb the thread to be made @c READY.
   @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
@@ -218,6 +480,21 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup many blocked threads at once.
+
+  This has the effect of calling @c wakeup() on each thread of the array,
+  but each core is locked only once for all its threads, and preemption
+  is turned off only once. Unlike @c wakeup(), no thread is handed the
+  rest of the caller's time-slice when the caller blocks.
+
+  @param tcbs the threads to be made @c READY. On return, the threads that
+     were not @c STOPPED or @c INIT are replaced by @c NULL.
+  @param n the number of threads in the array
+  @returns the number of threads made @c READY
+*/
+int wakeup_many(TCB* tcbs[], int n);
+
 /** 
   @brief Block the current thread.
 
@@ -272,8 +549,151 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param policy the scheduling policy of normal threads
+ */
+void initialize_scheduler(sched_policy policy);
+
+/**
+  @brief Print the wakeup latency percentiles of every core and cause.
+
+  This is called at shutdown, by core 0, and does nothing unless
+  the environment variable @c TINYOS_LATENCY is set.
+
+  @param f the file to print to
  */
-void initialize_scheduler(void);
+void sched_latency_report(FILE* f);
+
+/**
+  @brief Print the stack usage of every task.
+
+  This is called at shutdown, by core 0, and does nothing unless
+  stack accounting is on (the environment variable @c TINYOS_STACK is set).
+
+  @param f the file to print to
+  @see GetStackUsage
+ */
+void stack_usage_report(FILE* f);
+
+/**
+  @brief Set the affinity of a thread.
+
+  If the thread is not running and its core is not in @c mask, it is moved
+  to an allowed core at once. If it is the current thread, it yields, so that
+  it is moved as well. Other running threads move at their next yield.
+
+  @param tcb the thread
+  @param mask the new affinity; it must contain at least one existing core
+  @returns 0 on success, or -1 if the thread is real-time and @c mask excludes
+     the core it is admitted to
+*/
+int set_thread_affinity(TCB* tcb, uint32_t mask);
+
+/**
+  @brief Make a thread real-time, or normal again.
+
+  A real-time thread is given @c runtime usec of CPU in every @c period,
+  to be used within @c deadline usec from the start of the period. 
+  Ready real-time threads run before all other threads, in order of 
+  earliest deadline. A thread that uses up its runtime is throttled until 
+  its next period.
+
+  Real-time threads are partitioned: each is admitted to one core of its
+  affinity, chosen so that the total utilization @c runtime/period of each 
+  core's real-time threads stays below @c RT_UTIL_MAX.
+
+  @param tcb the thread
+  @param runtime the runtime per period, or 0 to make the thread normal
+  @param period the period
+  @param deadline the relative deadline, with @c runtime <= @c deadline <= @c period
+  @returns 0 on success, or -1 if no allowed core can admit the thread
+*/
+int set_thread_realtime(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline);
+
+/**
+  @brief Set the nice value of a thread.
+
+  A queued thread is requeued at once, according to its new nice value.
+
+  @param tcb the thread
+  @param nice the new nice value, from 0 to @c MAX_NICE
+*/
+void set_thread_nice(TCB* tcb, int nice);
+
+/**
+  @brief The highest MLFQ priority level of a thread with the given nice value.
+  */
+#define NICE_PRIORITY(nice) ((nice) * (QUEUE_AMOUNT - 1) / MAX_NICE)
+
+/**
+  @brief The priority level a thread is scheduled at.
+
+  This is the better of the thread's own MLFQ priority and its inherited
+  priority. A real-time thread counts as having the top level.
+  */
+int effective_priority(TCB* tcb);
+
+/**
+  @brief Set the inherited priority of a thread.
+
+  This is used for priority inheritance: the holder of a lock inherits the
+  best @c effective_priority() of the threads waiting for it, so that it is
+  not starved while it blocks them. A queued thread is requeued at once.
+  The inheritance is dropped by passing @c QUEUE_AMOUNT.
+
+  Under the MLFQ policy, the thread is queued at the better of the two levels.
+  Under the fair policy, a thread with any inherited priority runs before the
+  other fair threads of its core. The round-robin policy ignores it.
+
+  @param tcb the thread
+  @param level the inherited priority level, or @c QUEUE_AMOUNT
+*/
+void set_inherited_priority(TCB* tcb, int level);
+
+/**
+  @brief Turn gang scheduling on or off for a process.
+
+  While a process in gang mode holds the gang slot, every core that becomes
+  free, or is interrupted for this purpose, runs a ready thread of the process,
+  until the shared quantum of the gang runs out.
+
+  @param pcb the process
+  @param on non-zero to turn gang mode on
+  @returns the previous mode
+*/
+int set_process_gang(PCB* pcb, int on);
+
+/**
+  @brief Set the CPU quota of a process.
+
+  The process gets a new budget at once. Its threads that wait for the next
+  quota period are released when that period starts.
+
+  @param pcb the process
+  @param quota the CPU time per period (usec), or 0 for no quota
+  @param period the period (usec)
+*/
+void set_process_quota(PCB* pcb, TimerDuration quota, TimerDuration period);
+
+/**
+  @brief Get the CPU usage of a thread.
+
+  The usage includes the current run of the thread, if it is running, or
+  its current wait, if it is ready.
+
+  @param tcb the thread, which must not have exited
+  @param usage where the usage is stored
+*/
+void get_thread_usage(TCB* tcb, cpu_usage* usage);
+
+/** @brief Add the CPU usage @c u to @c total. */
+static inline void cpu_usage_add(cpu_usage* total, const cpu_usage* u)
+{
+	total->cpu_time += u->cpu_time;
+	total->wait_time += u->wait_time;
+	total->voluntary += u->voluntary;
+	total->involuntary += u->involuntary;
+}
 
 /**
  * @brief Change the priority of a thread
@@ -286,21 +706,65 @@ void initialize_scheduler(void);
  */
 void change_priority(TCB* tcb, int increase);
 
-/**
- * @brief Increment all threads priorities by one
- *
- * This function iterates through all available threads in all queues
- * and increase their priority
- */
-void increase_all_priorities();
-
 /**
   @brief Quantum (in microseconds) 
 
   This is the default quantum for each thread, in microseconds.
+  The MLFQ policy scales it by the priority level of the thread (see 
+  @c MLFQ_MAX_QUANTUM).
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief The longest time-slice of the MLFQ policy (in microseconds)
+
+  The time-slice of a thread grows from @c QUANTUM/2 at the top level to 
+  this at the bottom level, and it is doubled (up to this) for a thread 
+  that used up its last two time-slices. A thread given a time-slice longer
+  than @c QUANTUM is preempted as soon as a thread of a better level becomes
+  ready, however little of its time-slice it has used. Timeouts do not wait
+  for the end of a time-slice (see @c gain()), but a ready thread of the
+  same level may wait this long, so it is kept at a few quanta.
+  */
+#define MLFQ_MAX_QUANTUM (4 * QUANTUM)
+
+/**
+  @brief Wakeup credit of the fair policy (in microseconds)
+
+  A thread that becomes ready after a sleep is placed at most this far
+  behind the least virtual runtime of its core. Thus, it runs soon, 
+  but it cannot claim the CPU for as long as it was asleep.
+  */
+#define FAIR_WAKEUP_CREDIT (QUANTUM / 2)
+
+/**
+  @brief Aging interval (in microseconds)
+
+  A ready thread that has waited this long in its queue is promoted
+  by one priority level. This keeps low-priority threads from starving.
+  */
+#define AGING_INTERVAL (50 * QUANTUM)
+
+/**
+  @brief Cache hot time (in microseconds)
+
+  A thread that left a core less than this long ago is assumed to still
+  have a warm cache at that core. Such threads are preferably run by
+  the same core, and are not stolen by other cores if there is a choice.
+  */
+#define CACHE_HOT_TIME (QUANTUM)
+
+/** @brief Fixed-point representation of 100% utilization of a core */
+#define RT_UTIL_ONE ((uint64_t)1 << 20)
+
+/**
+  @brief Maximum real-time utilization of a core
+
+  Admission control keeps the reservations of the real-time threads of
+  each core within this limit, leaving some time to the other threads.
+  */
+#define RT_UTIL_MAX (RT_UTIL_ONE * 9 / 10)
+
 /** @} */
 
 
@@ -63,11 +63,12 @@ Fid_t sys_Accept(Fid_t lsock)
     }
 
     scb_server->refcount++;
-    while(is_rlist_empty(&(scb_server->listener_s.queue))){
+    /* Stop waiting if the listener is closed, which empties the queue for good */
+    while(is_rlist_empty(&(scb_server->listener_s.queue)) && PORT_MAP[scb_server->port] == scb_server){
         kernel_wait(&(scb_server->listener_s.req_available), SCHED_IO);
     }
 
-    if (PORT_MAP[scb_server->port] == NULL){
+    if (PORT_MAP[scb_server->port] != scb_server){
         decrement_refcount(scb_server);
         return NOFILE;
     }
@@ -11,10 +11,23 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, const thread_attr* attr), (task, argl, args, attr))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, unsigned int mask), (tid, mask))\
+SYSCALL(GetThreadAffinity, unsigned int, (Tid_t tid), (tid))\
+SYSCALL(SetThreadRealtime, int, (Tid_t tid, const rt_attr* attr), (tid, attr))\
+SYSCALL(GetThreadRealtime, int, (Tid_t tid, rt_attr* attr), (tid, attr))\
+SYSCALL(GetThreadUsage, int, (Tid_t tid, cpu_usage* usage), (tid, usage))\
+SYSCALL(SetPriority, int, (Tid_t tid, int nice), (tid, nice))\
+SYSCALL(GetPriority, int, (Tid_t tid), (tid))\
+SYSCALL(SetGangMode, int, (int on), (on))\
+SYSCALL(SetProcessQuota, int, (Pid_t pid, unsigned long quota, unsigned long period), (pid, quota, period))\
+SYSCALL(GetProcessQuota, int, (Pid_t pid, unsigned long* quota, unsigned long* period), (pid, quota, period))\
+SYSCALL(SchedTraceDump, int, (const char* filename), (filename))\
+SYSCALL(GetProcessUsage, int, (Pid_t pid, cpu_usage* self, cpu_usage* children), (pid, self, children))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +42,9 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(GetSchedStats, int, (sched_stats* stats), (stats))\
+SYSCALL(GetSchedLatency, int, (int core, int cause, sched_latency* lat), (core, cause, lat))\
+SYSCALL(GetStackUsage, int, (Task task, stack_usage* usage), (task, usage))\
 
 
 
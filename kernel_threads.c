@@ -9,13 +9,27 @@
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+    return sys_CreateThreadEx(task, argl, args, NULL);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr)
 {
     if (task == NULL){
         return NOTHREAD;
     }
 
+    /* Checking the stack size, 0 is the default */
+    size_t stack_size = (attr != NULL) ? attr->stack_size : 0;
+    if (stack_size != 0 && (stack_size < THREAD_STACK_MIN || stack_size > THREAD_STACK_MAX)){
+        return NOTHREAD;
+    }
+
     /* Initializing a new tcb on the current pcb */
-    TCB* tcb = spawn_thread(CURPROC, start_sub_thread);
+    TCB* tcb = spawn_thread(CURPROC, start_sub_thread, task, stack_size);
 
     /* Initializing a new ptcb for the new thread */
     PTCB* ptcb = spawn_ptcb(task, argl, args);
@@ -161,6 +175,12 @@ void sys_ThreadExit(int exitval)
     ptcb->exitval = exitval;
     ptcb->exited = 1;
     CURPROC->thread_count--;
+
+    /* The process keeps the CPU usage of its exited threads */
+    cpu_usage u;
+    get_thread_usage(cur_thread(), &u);
+    cpu_usage_add(& CURPROC->usage, &u);
+
     kernel_broadcast(&ptcb->exit_cv);
 
     if(CURPROC->thread_count == 0) {
@@ -229,6 +249,149 @@ void sys_ThreadExit(int exitval)
     kernel_sleep(EXITED, SCHED_USER);
 }
 
+/*
+  Return the PTCB of a non-exited thread of the current process, or NULL.
+*/
+static PTCB* find_live_ptcb(Tid_t tid)
+{
+    rlnode* ptcb_node = rlist_find(& CURPROC->ptcb_list, (PTCB *) tid, NULL);
+    if (ptcb_node == NULL || ptcb_node->ptcb->exited)
+        return NULL;
+    return ptcb_node->ptcb;
+}
+
+/* The mask of the existing cores */
+static unsigned int all_cores_mask()
+{
+    return (cpu_cores() >= 32) ? ~0u : (1u << cpu_cores()) - 1;
+}
+
+/**
+  @brief Set the affinity of the given thread.
+
+  The mask is restricted to the existing cores. The scheduler moves the thread
+  to an allowed core, if needed.
+
+  @returns 0 on success
+  @returns -1 on failure
+  */
+int sys_SetThreadAffinity(Tid_t tid, unsigned int mask)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    mask &= all_cores_mask();
+    if (ptcb == NULL || mask == 0){
+        return -1;
+    }
+
+    return set_thread_affinity(ptcb->tcb, mask);
+}
+
+/**
+  @brief Return the affinity of the given thread, or 0 on failure.
+  */
+unsigned int sys_GetThreadAffinity(Tid_t tid)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    if (ptcb == NULL){
+        return 0;
+    }
+    return ptcb->tcb->affinity & all_cores_mask();
+}
+
+/**
+  @brief Make the given thread real-time, or normal if @c attr is NULL.
+
+  The attributes are checked here; admission control is done by the scheduler.
+
+  @returns 0 on success
+  @returns -1 on failure
+  */
+int sys_SetThreadRealtime(Tid_t tid, const rt_attr* attr)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    if (ptcb == NULL){
+        return -1;
+    }
+
+    if (attr == NULL){
+        return set_thread_realtime(ptcb->tcb, 0, 0, 0);
+    }
+
+    if (attr->runtime == 0 || attr->runtime > attr->deadline || attr->deadline > attr->period){
+        return -1;
+    }
+
+    return set_thread_realtime(ptcb->tcb, attr->runtime, attr->period, attr->deadline);
+}
+
+/**
+  @brief Return the real-time attributes of the given thread.
+
+  For a thread that is not real-time, all attributes are 0.
+
+  @returns 0 on success
+  @returns -1 on failure
+  */
+int sys_GetThreadRealtime(Tid_t tid, rt_attr* attr)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    if (ptcb == NULL || attr == NULL){
+        return -1;
+    }
+
+    TCB* tcb = ptcb->tcb;
+    attr->runtime = tcb->rt ? tcb->rt_runtime : 0;
+    attr->period = tcb->rt ? tcb->rt_period : 0;
+    attr->deadline = tcb->rt ? tcb->rt_deadline : 0;
+    return 0;
+}
+
+/**
+  @brief Set the nice value of the given thread.
+
+  @returns 0 on success
+  @returns -1 on failure
+  */
+int sys_SetPriority(Tid_t tid, int nice)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    if (ptcb == NULL || nice < 0 || nice > MAX_NICE){
+        return -1;
+    }
+
+    set_thread_nice(ptcb->tcb, nice);
+    return 0;
+}
+
+/**
+  @brief Return the nice value of the given thread, or -1 on failure.
+  */
+int sys_GetPriority(Tid_t tid)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    if (ptcb == NULL){
+        return -1;
+    }
+    return ptcb->tcb->nice;
+}
+
+/**
+  @brief Return the CPU usage of the given thread.
+
+  @returns 0 on success
+  @returns -1 on failure
+  */
+int sys_GetThreadUsage(Tid_t tid, cpu_usage* usage)
+{
+    PTCB* ptcb = find_live_ptcb(tid);
+    if (ptcb == NULL || usage == NULL){
+        return -1;
+    }
+
+    get_thread_usage(ptcb->tcb, usage);
+    return 0;
+}
+
 /*
   Initialize and return a new PTCB
 */
@@ -0,0 +1,241 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "kernel_trace.h"
+#include "kernel_proc.h"
+
+/**
+	@file kernel_trace.c
+	@brief The scheduler event trace.
+
+	Each core has a ring of events and a head counter. The core writes the
+	event at the head slot and then publishes it by incrementing the head
+	(with release order). A reader copies the events behind the head, and
+	then reads the head again: a copied event is valid if the writer had
+	not started to overwrite its slot, i.e., if the new head is less than
+	a ring size ahead of it.
+*/
+
+/* The thread of an event. Threads are recorded by value, since they may
+   be gone when the trace is dumped. */
+typedef struct trace_thread {
+	int pid;        /* NOPROC for an idle thread, or no thread */
+	uintptr_t tid;  /* The Tid_t of the thread, 0 for an idle thread */
+	uint core;      /* The core of the thread */
+} trace_thread;
+
+typedef struct trace_entry {
+	TimerDuration ts;  /* precise clock (usec) */
+	trace_type type;
+	int arg;
+	trace_thread thread, other;
+} trace_entry;
+
+typedef struct trace_ring {
+	unsigned long head;  /* The number of events written so far */
+	trace_entry ev[TRACE_RING_SIZE];
+} trace_ring;
+
+int trace_enabled = 0;
+static trace_ring* trace_rings = NULL;
+static uint trace_ncores = 0;
+static const char* trace_file = NULL;
+
+
+static inline void trace_set_thread(trace_thread* t, TCB* tcb)
+{
+	if (tcb == NULL || tcb->type == IDLE_THREAD) {
+		t->pid = NOPROC;
+		t->tid = 0;
+	} else {
+		t->pid = get_pid(tcb->owner_pcb);
+		t->tid = (uintptr_t) tcb->ptcb;
+	}
+	t->core = (tcb != NULL) ? tcb->core : 0;
+}
+
+void trace_record(trace_type type, TCB* tcb, TCB* other, int arg)
+{
+	trace_ring* ring = &trace_rings[cpu_core_id];
+	unsigned long h = ring->head;
+	trace_entry* e = &ring->ev[h & (TRACE_RING_SIZE - 1)];
+
+	e->ts = bios_precise_clock();
+	e->type = type;
+	e->arg = arg;
+	trace_set_thread(&e->thread, tcb);
+	trace_set_thread(&e->other, other);
+
+	__atomic_store_n(&ring->head, h + 1, __ATOMIC_RELEASE);
+}
+
+
+void initialize_trace(uint ncores)
+{
+	trace_file = getenv("TINYOS_TRACE");
+	if (trace_file == NULL || *trace_file == '\0')
+		return;
+
+	trace_rings = calloc(ncores, sizeof(trace_ring));
+	if (trace_rings == NULL)
+		return;
+	trace_ncores = ncores;
+	trace_enabled = 1;
+}
+
+
+/*
+	Dumping
+ */
+
+/* Print the name of a thread */
+static void print_thread(FILE* f, trace_thread* t)
+{
+	if (t->pid == NOPROC)
+		fprintf(f, "\"idle\"");
+	else
+		fprintf(f, "\"p%d:t%lx\"", t->pid, (unsigned long) t->tid);
+}
+
+/*
+	Copy the valid events of a ring into 'buf', oldest first, and return
+	their number.
+ */
+static unsigned long trace_snapshot(trace_ring* ring, trace_entry* buf)
+{
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned long first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+	for (unsigned long i = first; i < head; i++)
+		buf[i - first] = ring->ev[i & (TRACE_RING_SIZE - 1)];
+
+	/* Drop the events whose slots were overwritten while we copied */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	unsigned long now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	unsigned long valid = (now >= TRACE_RING_SIZE) ? now - TRACE_RING_SIZE + 1 : 0;
+	if (valid <= first)
+		return head - first;
+	if (valid >= head)
+		return 0;
+	for (unsigned long i = valid; i < head; i++)
+		buf[i - valid] = buf[i - first];
+	return head - valid;
+}
+
+/* Print the header of an event, on the row of its core (it follows the metadata) */
+static void print_event(FILE* f, int* count, const char* ph, uint core, TimerDuration ts)
+{
+	(*count)++;
+	fprintf(f, ",\n{\"ph\":\"%s\",\"pid\":0,\"tid\":%u,\"ts\":%lu",
+		ph, core, (unsigned long) ts);
+}
+
+int trace_dump(FILE* f)
+{
+	if (!trace_enabled)
+		return -1;
+
+	trace_entry* buf = malloc(sizeof(trace_entry) * TRACE_RING_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	int count = 0;
+	fprintf(f, "{\"traceEvents\":[");
+	fprintf(f, "\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":0,\"args\":{\"name\":\"tinyos\"}}");
+
+	TimerDuration end = bios_precise_clock();
+	for (uint c = 0; c < trace_ncores; c++) {
+		fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"name\":\"core %u\"}}", c, c);
+
+		unsigned long n = trace_snapshot(&trace_rings[c], buf);
+
+		/* A thread runs at the core from one switch to the next */
+		trace_entry* run = NULL;
+		for (unsigned long i = 0; i <= n; i++) {
+			trace_entry* e = (i < n) ? &buf[i] : NULL;
+			if (run != NULL && (e == NULL || e->type == TRACE_SWITCH)) {
+				print_event(f, &count, "X", c, run->ts);
+				fprintf(f, ",\"dur\":%lu,\"name\":", (unsigned long)((e ? e->ts : end) - run->ts));
+				print_thread(f, &run->thread);
+				fprintf(f, "}");
+			}
+			if (e == NULL)
+				break;
+
+			switch (e->type) {
+			case TRACE_SWITCH:
+				run = (e->thread.pid == NOPROC) ? NULL : e;
+				print_event(f, &count, "i", c, e->ts);
+				fprintf(f, ",\"s\":\"t\",\"name\":\"switch\",\"args\":{\"from\":");
+				print_thread(f, &e->other);
+				fprintf(f, ",\"to\":");
+				print_thread(f, &e->thread);
+				fprintf(f, ",\"cause\":\"%s\"}}", sched_cause_name(e->arg));
+				break;
+			case TRACE_WAKEUP:
+				print_event(f, &count, "i", c, e->ts);
+				fprintf(f, ",\"s\":\"t\",\"name\":\"wakeup\",\"args\":{\"thread\":");
+				print_thread(f, &e->thread);
+				fprintf(f, ",\"waker\":");
+				print_thread(f, &e->other);
+				fprintf(f, "}}");
+				break;
+			case TRACE_BLOCK:
+				print_event(f, &count, "i", c, e->ts);
+				fprintf(f, ",\"s\":\"t\",\"name\":\"block\",\"args\":{\"thread\":");
+				print_thread(f, &e->thread);
+				fprintf(f, ",\"cause\":\"%s\"}}", sched_cause_name(e->arg));
+				break;
+			case TRACE_TIMEOUT:
+				print_event(f, &count, "i", c, e->ts);
+				fprintf(f, ",\"s\":\"t\",\"name\":\"timeout\",\"args\":{\"thread\":");
+				print_thread(f, &e->thread);
+				fprintf(f, "}}");
+				break;
+			case TRACE_MIGRATE:
+				print_event(f, &count, "i", c, e->ts);
+				fprintf(f, ",\"s\":\"t\",\"name\":\"migrate\",\"args\":{\"thread\":");
+				print_thread(f, &e->thread);
+				fprintf(f, ",\"from\":%d,\"to\":%u}}", e->arg, e->thread.core);
+				break;
+			}
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	free(buf);
+	return count;
+}
+
+
+int sys_SchedTraceDump(const char* filename)
+{
+	if (!trace_enabled || filename == NULL)
+		return -1;
+
+	FILE* f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	int count = trace_dump(f);
+	fclose(f);
+	return count;
+}
+
+
+void finalize_trace()
+{
+	if (!trace_enabled)
+		return;
+
+	FILE* f = fopen(trace_file, "w");
+	if (f != NULL) {
+		trace_dump(f);
+		fclose(f);
+	} else
+		perror("tinyos: cannot write the trace");
+
+	trace_enabled = 0;
+	free(trace_rings);
+	trace_rings = NULL;
+	trace_ncores = 0;
+}
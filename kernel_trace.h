@@ -0,0 +1,93 @@
+/*
+ *  Scheduler event trace
+ *
+ */
+
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+#include <stdio.h>
+#include "kernel_sched.h"
+
+/**
+	@file kernel_trace.h
+	@brief Scheduler event trace.
+
+	@defgroup trace Trace.
+	@ingroup kernel
+	@brief Scheduler event trace.
+
+	When tracing is on, the scheduler records its events (context switches,
+	wakeups, blocking, timeouts and migrations) in a ring buffer per core.
+	Each core writes only to its own ring, with preemption off, so no lock
+	is needed. A reader may dump the rings at any time, in the Chrome
+	trace-event JSON format, which can be viewed in a browser
+	(chrome://tracing or https://ui.perfetto.dev).
+
+	Tracing is turned on at boot, if the environment variable
+	@c TINYOS_TRACE is set to a file name. The trace is dumped to this
+	file when the VM shuts down. It can also be dumped on demand, by
+	@c SchedTraceDump().
+
+	@{
+*/
+
+/** @brief The number of events kept per core (a power of 2). Older events are overwritten. */
+#define TRACE_RING_SIZE 8192
+
+/** @brief The types of trace events */
+typedef enum trace_type {
+	TRACE_SWITCH,   /**< @brief A core switched from @c other to @c tcb, @c arg is the cause */
+	TRACE_WAKEUP,   /**< @brief @c tcb was made ready by @c other (NULL for the scheduler) */
+	TRACE_BLOCK,    /**< @brief @c tcb blocked, @c arg is the cause */
+	TRACE_TIMEOUT,  /**< @brief The sleep timeout of @c tcb expired */
+	TRACE_MIGRATE   /**< @brief @c tcb moved from core @c arg to core @c tcb->core */
+} trace_type;
+
+/** @brief Non-zero while tracing is on */
+extern int trace_enabled;
+
+/** @brief Record an event at the current core (must be called with preemption off) */
+void trace_record(trace_type type, TCB* tcb, TCB* other, int arg);
+
+/**
+	@brief Record an event at the current core, if tracing is on.
+
+	This must be called with preemption off.
+*/
+static inline void trace_event(trace_type type, TCB* tcb, TCB* other, int arg)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record(type, tcb, other, arg);
+}
+
+/**
+	@brief Initialize tracing for a new boot of the VM.
+
+	Tracing is turned on if @c TINYOS_TRACE is set.
+
+	@param ncores the number of cores
+*/
+void initialize_trace(uint ncores);
+
+/**
+	@brief Write the events in the rings to a file, in Chrome trace-event JSON.
+
+	This may be called while the cores are running. Events overwritten
+	while they are read are skipped.
+
+	@param f the file
+	@returns the number of events written, or -1 if tracing is off
+*/
+int trace_dump(FILE* f);
+
+/**
+	@brief Dump the trace to the file named by @c TINYOS_TRACE, and turn tracing off.
+
+	This is called after the VM shuts down.
+*/
+void finalize_trace();
+
+/** @} */
+
+#endif
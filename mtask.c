@@ -1,6 +1,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
@@ -57,8 +58,9 @@ int boot_symposium(int argl, void* args)
 
 void usage(const char* pname)
 {
-  printf("usage:\n  %s <ncores> <nterm> <philosophers> <bites> [<Dbase>] [<Dgap>]\n\n  \
+  printf("usage:\n  %s [-s <policy>] <ncores> <nterm> <philosophers> <bites> [<Dbase>] [<Dgap>]\n\n  \
     where:\n\
+    <policy> is the scheduling policy: mlfq (the default), rr or fair,\n\
     <ncores> is the number of cpu cores to use,\n\
     <nterm> is the number of terminals to use,\n\
     <philosiphers> is from 1 to %d\n\
@@ -74,13 +76,35 @@ void usage(const char* pname)
 int FMIN= FBASE;
 int FMAX= FBASE+FGAP;
 
+/* Parse the name of a scheduling policy, return -1 if it is unknown */
+static int parse_policy(const char* name, sched_policy* policy)
+{
+  static const char* names[] = { 
+    [SCHED_POLICY_MLFQ] = "mlfq", [SCHED_POLICY_RR] = "rr", [SCHED_POLICY_FAIR] = "fair" 
+  };
+  for(int i=0; i<sizeof(names)/sizeof(names[0]); i++)
+    if(strcmp(name, names[i])==0) {
+      *policy = i;
+      return 0;
+    }
+  return -1;
+}
+
 int main(int argc, const char** argv) 
 {
   unsigned int ncores, nterm;
   int nphil, bites;
   int dBase = 0, dGap = 0;
+  sched_policy policy = SCHED_POLICY_MLFQ;
+  const char* pname = argv[0];
+
+  if(argc > 2 && strcmp(argv[1], "-s")==0) {
+    if(parse_policy(argv[2], &policy)) usage(pname);
+    argc -= 2;
+    argv += 2;
+  }
 
-  if(argc < 5 || argc > 7) usage(argv[0]); 
+  if(argc < 5 || argc > 7) usage(pname); 
   ncores = atoi(argv[1]);
   nterm = atoi(argv[2]);
   nphil = atoi(argv[3]);
@@ -90,8 +114,8 @@ int main(int argc, const char** argv)
 
   /* check arguments */
 
-  if( (nphil <= 0) || (nphil > MAX_PROC) ) usage(argv[0]); 
-  if( (bites <= 0) ) usage(argv[0]); 
+  if( (nphil <= 0) || (nphil > MAX_PROC) ) usage(pname); 
+  if( (bites <= 0) ) usage(pname); 
 
   /* adjust work per fibo call (to adapt to many philosophers/bites) */
   symposium_t symp;
@@ -101,7 +125,7 @@ int main(int argc, const char** argv)
 
   /* boot TinyOS */
   printf("*** Booting TinyOS\n");
-  boot(ncores, nterm, boot_symposium, sizeof(symp), &symp);
+  boot_with_policy(ncores, nterm, policy, boot_symposium, sizeof(symp), &symp);
   fprintf(stderr,"FMIN = %d    FMAX = %d\n",symp.fmin,symp.fmax);
   printf("*** TinyOS halted. Bye!\n");
 
@@ -130,6 +130,7 @@ BARE_TEST(test_list_queue,
 		ASSERT(I==p);
 		I++;
 	}
+	ASSERT(I==n+10);
 
 	ASSERT(is_rlist_empty(&L));
 
@@ -268,6 +269,136 @@ TEST_SUITE(rlist_tests,
 
 
 
+/* Unit tests for the ordered trees */
+
+/* Check the tree order and the heap order, and return the number of nodes */
+static int treap_check(tnode* t, tnode* lo, tnode* hi)
+{
+	if(t == NULL) return 0;
+	ASSERT(lo == NULL || treap_less(lo, t));
+	ASSERT(hi == NULL || treap_less(t, hi));
+	ASSERT(t->left == NULL || treap_priority(t->left) <= treap_priority(t));
+	ASSERT(t->right == NULL || treap_priority(t->right) <= treap_priority(t));
+	return 1 + treap_check(t->left, lo, t) + treap_check(t->right, t, hi);
+}
+
+
+BARE_TEST(test_treap_order,
+	"Test that the minimum of a treap is removed in key order"
+	)
+{
+	tnode n[100];
+	tnode* root = NULL;
+	ASSERT(treap_min(root) == NULL);
+
+	for(int i=0; i<100; i++) {
+		n[i].key = (i * 37) % 10;   /* many equal keys */
+		n[i].num = i;
+		root = treap_insert(root, n+i);
+		ASSERT(treap_check(root, NULL, NULL) == i+1);
+	}
+
+	ASSERT(treap_min(root)->key == 0);
+	ASSERT(treap_max(root)->key == 9);
+
+	uint64_t last = 0;
+	for(int i=0; i<100; i++) {
+		tnode* m = treap_min(root);
+		ASSERT(m->key >= last);
+		last = m->key;
+		root = treap_remove(root, m);
+		ASSERT(treap_check(root, NULL, NULL) == 99-i);
+	}
+	ASSERT(root == NULL);
+}
+
+
+BARE_TEST(test_treap_remove,
+	"Test removal of arbitrary treap nodes"
+	)
+{
+	tnode n[64];
+	tnode* root = NULL;
+	for(int i=0; i<64; i++) {
+		n[i].key = 1000 - 3*i;
+		root = treap_insert(root, n+i);
+	}
+
+	/* Remove every other node */
+	for(int i=0; i<64; i+=2)
+		root = treap_remove(root, n+i);
+	ASSERT(treap_check(root, NULL, NULL) == 32);
+
+	/* Removing a node not in the tree changes nothing */
+	root = treap_remove(root, n);
+	ASSERT(treap_check(root, NULL, NULL) == 32);
+
+	ASSERT(treap_min(root) == n+63);
+	ASSERT(treap_max(root) == n+1);
+}
+
+
+TEST_SUITE(treap_tests,
+	"Tests for the ordered trees")
+{
+	&test_treap_order,
+	&test_treap_remove,
+	NULL
+};
+
+
+/* Unit tests for the log-linear histograms */
+
+BARE_TEST(test_loghist_buckets,
+	"Test that every value falls in a bucket of bounded width"
+	)
+{
+	ASSERT(loghist_bucket(0) == 0);
+	ASSERT(loghist_upper(LOGHIST_BUCKETS-1) == UINT32_MAX);
+	ASSERT(loghist_bucket(UINT32_MAX) == LOGHIST_BUCKETS-1);
+	ASSERT(loghist_bucket((uint64_t)1 << 40) == LOGHIST_BUCKETS-1);
+
+	for(uint64_t v=1; v < ((uint64_t)1 << 32); v += 1 + v/37) {
+		unsigned int b = loghist_bucket(v);
+		ASSERT(b < LOGHIST_BUCKETS);
+		ASSERT(v <= loghist_upper(b));
+		ASSERT(b == 0 || v > loghist_upper(b-1));
+		/* The relative width of a bucket is at most 1/LOGHIST_SUB */
+		ASSERT(loghist_upper(b) - v <= v / LOGHIST_SUB);
+	}
+}
+
+
+BARE_TEST(test_loghist_percentile,
+	"Test the percentiles of a histogram"
+	)
+{
+	unsigned long hist[LOGHIST_BUCKETS] = { 0 };
+	ASSERT(loghist_percentile(hist, 50.0) == 0);
+
+	for(uint64_t v=1; v<=1000; v++)
+		hist[loghist_bucket(v)]++;
+	ASSERT(loghist_count(hist) == 1000);
+
+	uint64_t p50 = loghist_percentile(hist, 50.0);
+	uint64_t p99 = loghist_percentile(hist, 99.0);
+	ASSERT(p50 >= 500 && p50 <= 500 + 500/LOGHIST_SUB);
+	ASSERT(p99 >= 990 && p99 <= 990 + 990/LOGHIST_SUB);
+	ASSERT(loghist_percentile(hist, 0.0) == 1);
+	ASSERT(loghist_percentile(hist, 100.0) >= 1000);
+}
+
+
+TEST_SUITE(loghist_tests,
+	"Tests for the log-linear histograms")
+{
+	&test_loghist_buckets,
+	&test_loghist_percentile,
+	NULL
+};
+
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -321,6 +452,8 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&treap_tests,
+	&loghist_tests,
 	&test_pack_unpack,
 	NULL
 };
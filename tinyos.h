@@ -70,13 +70,13 @@ typedef uintptr_t Tid_t;
   
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation 
-    of the kernel.
+    of the kernel. A locked mutex records the thread that holds it.
 
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +92,8 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking will block after spinning for a few hundred times,
+  and the thread holding the mutex inherits the priority of the blocked thread until it unlocks.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -103,7 +104,7 @@ void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. Any threads blocked on the mutex are woken up.
     @see Mutex
     @see Mutex_Lock
 */
@@ -319,6 +320,42 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** @brief The smallest thread stack size that can be requested (16 kbytes). */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The largest thread stack size that can be requested (64 Mbytes). */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
+/**
+  @brief Attributes of a new thread.
+
+  @see CreateThreadEx
+ */
+typedef struct thread_attr
+{
+  unsigned long stack_size;  /**< @brief The stack size (bytes), or 0 for the default (128 kbytes,
+                                  or less if auto-sized, see @c GetStackUsage).
+                                  It is rounded up to a multiple of the page size. */
+} thread_attr;
+
+/**
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This is like @c CreateThread, except that the new thread is set up by
+  @c attr. Small stacks let many lightweight threads (e.g., I/O handlers)
+  fit in the same memory, and large stacks allow deep recursion.
+
+  @param task a function to execute
+  @param argl the first argument to @c task
+  @param args the second argument to @c task
+  @param attr the attributes of the new thread, or NULL for the defaults
+  @returns the Tid of the new thread, or @c NOTHREAD on error. Possible errors are:
+    - @c task is NULL.
+    - the stack size is not 0 and not between @c THREAD_STACK_MIN and @c THREAD_STACK_MAX.
+  @see CreateThread
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +411,222 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the cores that a thread may run on.
+
+  Bit @c c of @c mask allows the thread to run on core @c c. Bits that 
+  correspond to non-existent cores are ignored. A thread that is not running
+  is moved to an allowed core at once. A thread that calls this on itself
+  moves at once as well. Other running threads move at their next 
+  scheduling point (at most one quantum later).
+
+  Threads created by @c CreateThread or @c Exec inherit the affinity of 
+  their creator. Initially, a thread may run on any core.
+
+  @param tid the tid of a thread of the current process
+  @param mask the set of allowed cores
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - @c mask contains no existing core.
+    - the thread is real-time and @c mask excludes the core it was admitted to.
+  @see GetThreadAffinity
+  */
+int SetThreadAffinity(Tid_t tid, unsigned int mask);
+
+/**
+  @brief Return the cores that a thread may run on.
+
+  @param tid the tid of a thread of the current process
+  @returns the affinity mask of the thread, restricted to the existing
+    cores, or 0 if there is no such (non-exited) thread in this process.
+  @see SetThreadAffinity
+  */
+unsigned int GetThreadAffinity(Tid_t tid);
+
+/**
+  @brief Real-time scheduling attributes of a thread.
+
+  A real-time thread is guaranteed @c runtime microseconds of CPU time in 
+  every @c period microseconds, within @c deadline microseconds from the
+  start of each period. It must hold that 
+  @c 0 < @c runtime <= @c deadline <= @c period.
+
+  @see SetThreadRealtime
+  */
+typedef struct rt_attr
+{
+  unsigned long runtime;   /**< @brief CPU time per period (usec). */
+  unsigned long period;    /**< @brief The period (usec). */
+  unsigned long deadline;  /**< @brief The relative deadline (usec). */
+} rt_attr;
+
+/**
+  @brief Make a thread real-time (or normal again).
+
+  Ready real-time threads are scheduled ahead of all other threads, in
+  order of earliest deadline first (EDF). A real-time thread that has used
+  its runtime in the current period is not scheduled again until the next
+  period starts.
+
+  Each real-time thread is admitted to one core of its affinity, and stays
+  there. The call fails if no such core has enough spare capacity, i.e., if
+  the sum of @c runtime/period of its real-time threads would exceed 90%.
+
+  @param tid the tid of a thread of the current process
+  @param attr the real-time attributes, or NULL to make the thread normal
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the attributes are not valid.
+    - the thread cannot be admitted to any core of its affinity.
+  @see GetThreadRealtime
+  */
+int SetThreadRealtime(Tid_t tid, const rt_attr* attr);
+
+/**
+  @brief Return the real-time attributes of a thread.
+
+  For a thread that is not real-time, all attributes are set to 0.
+
+  @param tid the tid of a thread of the current process
+  @param attr the structure to fill
+  @returns 0 on success, and -1 on error (no such thread, or @c attr is NULL).
+  @see SetThreadRealtime
+  */
+int GetThreadRealtime(Tid_t tid, rt_attr* attr);
+
+
+/** @brief The largest (i.e., least favourable) nice value. */
+#define MAX_NICE 19
+
+/**
+  @brief Set the nice value of a thread.
+
+  The nice value of a thread, from 0 (the default) to @c MAX_NICE, lowers 
+  its priority with respect to other threads. Under the MLFQ policy, it 
+  sets the highest priority level that the thread can reach: a thread with
+  nice value 0 may use all levels, and one with nice value @c MAX_NICE
+  only the lowest level. Under the fair policy, each step of the nice value
+  makes the CPU share of the thread about 20% smaller. The round-robin policy
+  ignores nice values. Real-time threads are not affected.
+
+  New threads, including the main thread of a process created by @c Exec,
+  inherit the nice value of the thread that creates them.
+
+  @param tid the tid of a thread of the current process
+  @param nice the nice value, from 0 to @c MAX_NICE
+  @returns 0 on success, or -1 if there is no live thread @c tid in the 
+     current process, or @c nice is out of range.
+  @see GetPriority
+  */
+int SetPriority(Tid_t tid, int nice);
+
+/**
+  @brief Return the nice value of a thread.
+
+  @param tid the tid of a thread of the current process
+  @returns the nice value, or -1 if there is no live thread @c tid in the
+     current process.
+  @see SetPriority
+  */
+int GetPriority(Tid_t tid);
+
+
+/**
+  @brief Turn gang scheduling on or off for the current process.
+
+  The threads of a process in gang mode are scheduled together: when one of
+  them is dispatched, the other cores are interrupted, and each runs a ready
+  thread of the process for the rest of the same quantum. This helps 
+  fine-grained parallel programs, whose threads often wait for each other 
+  (e.g., at a barrier), when one of them would otherwise be descheduled.
+
+  Only one process holds the cores at a time. Real-time threads still take
+  precedence. Threads that are already queued join the gang when they are 
+  next queued.
+
+  @param on non-zero to turn gang mode on, zero to turn it off
+  @returns the previous mode (0 or 1)
+  */
+int SetGangMode(int on);
+
+
+/**
+  @brief Limit the CPU time of a process.
+
+  The threads of the process may use, in total, @c quota microseconds of 
+  CPU time in every @c period microseconds. When the budget of a period
+  is used up, the threads of the process are not scheduled until the next
+  period starts. On many cores, @c quota may exceed @c period; e.g., a quota
+  of 200000 per 100000 allows the process about two cores. Real-time threads
+  are not limited by the quota.
+
+  A process created by @c Exec gets the quota of its parent, with a budget
+  of its own.
+
+  @param pid the process, or @c NOPROC for the current process
+  @param quota the CPU time per period (usec), or 0 to remove the limit
+  @param period the period (usec), if @c quota is not 0
+  @returns 0 on success, or -1 if there is no such process, or @c quota 
+     is not 0 and @c period is 0.
+  @see GetProcessQuota
+  */
+int SetProcessQuota(Pid_t pid, unsigned long quota, unsigned long period);
+
+/**
+  @brief Return the CPU quota of a process.
+
+  @param pid the process, or @c NOPROC for the current process
+  @param quota if not NULL, the CPU time per period is stored here (0 if there is no quota)
+  @param period if not NULL, the period is stored here
+  @returns 0 on success, or -1 if there is no such process.
+  @see SetProcessQuota
+  */
+int GetProcessQuota(Pid_t pid, unsigned long* quota, unsigned long* period);
+
+
+/**
+  @brief CPU usage of a thread or process.
+
+  @see GetThreadUsage
+  @see GetProcessUsage
+  */
+typedef struct cpu_usage
+{
+  unsigned long cpu_time;     /**< @brief Time spent running (usec). */
+  unsigned long wait_time;    /**< @brief Time spent ready, waiting for a core (usec). */
+  unsigned long voluntary;    /**< @brief Context switches because the thread blocked. */
+  unsigned long involuntary;  /**< @brief Context switches because the thread was preempted, or yielded. */
+} cpu_usage;
+
+/**
+  @brief Return the CPU usage of a thread of the current process.
+
+  @param tid the tid of a thread of the current process
+  @param usage the location where the usage is stored
+  @returns 0 on success, or -1 if @c usage is NULL, or if there is no
+     thread @c tid in the current process, or the thread has exited.
+  @see GetProcessUsage
+  */
+int GetThreadUsage(Tid_t tid, cpu_usage* usage);
+
+/**
+  @brief Return the CPU usage of a process, and of its reaped children.
+
+  The usage of a process is the sum of the usage of all its threads, 
+  live or exited. The usage of its children is the sum of the usage of
+  all its child processes that have been cleaned up by @c WaitChild(), 
+  including the usage of their own reaped children. A process that is
+  reparented to the init process is counted in the children of init.
+
+  @param pid the pid of a live or zombie process
+  @param self where the usage of the process is stored, or NULL
+  @param children where the usage of the reaped children is stored, or NULL
+  @returns 0 on success, or -1 if @c pid is not a valid process.
+  */
+int GetProcessUsage(Pid_t pid, cpu_usage* self, cpu_usage* children);
+
 
 
 /*******************************************
@@ -760,6 +1013,149 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+	@brief Scheduler statistics, since boot.
+
+	@see GetSchedStats
+  */
+typedef struct sched_stats
+{
+	unsigned long migrations;  /**< @brief Times a thread moved to a different core. */
+	unsigned long steals;      /**< @brief Migrations done by an idle core taking a ready 
+	                                thread from another core. */
+	unsigned long handoffs;    /**< @brief Times a blocking thread switched directly to a 
+	                                thread it had woken up. */
+	unsigned long gang_dispatches; /**< @brief Times a thread was dispatched to run together 
+	                                with the other threads of its process (see @c SetGangMode). */
+	unsigned long threads_reused;  /**< @brief Threads created with the stack of a thread that 
+	                                had exited, instead of new memory. */
+} sched_stats;
+
+
+/**
+	@brief Return scheduler statistics.
+
+	The counters are summed over all cores. They are read without 
+	synchronization, so they are only approximate while threads are running.
+
+	@param stats the structure to fill
+	@returns 0 on success, or -1 if @c stats is NULL.
+ */
+int GetSchedStats(sched_stats* stats);
+
+
+/**
+	@brief Wakeup latency percentiles, since boot.
+
+	The wakeup latency of a thread is the time from when it becomes
+	ready (e.g., it is woken up by another thread, or its sleep times out)
+	until it actually runs. The percentiles are computed from histograms
+	whose buckets are at most 1/8 of their value wide, and are rounded up
+	to the end of their bucket.
+
+	@see GetSchedLatency
+  */
+typedef struct sched_latency
+{
+	unsigned long count;  /**< @brief The number of wakeups measured */
+	unsigned long p50;    /**< @brief The median latency (usec) */
+	unsigned long p99;    /**< @brief The 99th percentile of the latency (usec) */
+	unsigned long p999;   /**< @brief The 99.9th percentile of the latency (usec) */
+} sched_latency;
+
+
+/**
+	@brief The reasons a thread may have stopped running for.
+
+	@see GetSchedLatency
+  */
+typedef enum {
+	SCHED_CAUSE_QUANTUM,  /**< @brief Its time-slice expired */
+	SCHED_CAUSE_IO,       /**< @brief It waited for I/O */
+	SCHED_CAUSE_MUTEX,    /**< @brief It waited for a mutex */
+	SCHED_CAUSE_PIPE,     /**< @brief It waited at a pipe or socket */
+	SCHED_CAUSE_POLL,     /**< @brief It polled a device */
+	SCHED_CAUSE_IDLE,     /**< @brief It is the idle thread */
+	SCHED_CAUSE_USER,     /**< @brief It waited on a condition variable, or slept */
+	SCHED_CAUSE_PREEMPT   /**< @brief A more urgent thread became ready at its core */
+} sched_cause;
+
+/**
+	@brief Return the wakeup latency percentiles of a core, or of all cores.
+
+	Each core keeps a histogram of the latency of the threads it runs, 
+	for every reason a thread may have stopped for. They are read without 
+	synchronization, so they are only approximate while threads are running. 
+	If the environment variable @c TINYOS_LATENCY is set at shutdown, the
+	percentiles of every core and reason are printed to @c stderr.
+
+	@param core the core, or -1 for all cores
+	@param cause the reason the threads had stopped for (a @c sched_cause),
+	   or -1 for all reasons
+	@param lat the structure to fill
+	@returns 0 on success, or -1 if @c lat is NULL, or @c core or @c cause 
+	   is not valid.
+ */
+int GetSchedLatency(int core, int cause, sched_latency* lat);
+
+
+/**
+	@brief The stack usage of the threads of a task, since boot.
+
+	@see GetStackUsage
+  */
+typedef struct stack_usage
+{
+	unsigned long threads;    /**< @brief The number of exited threads measured */
+	unsigned long max_used;   /**< @brief The deepest stack use of these threads (bytes) */
+	unsigned long auto_size;  /**< @brief The stack size given to new threads of the task
+	                               by default, 0 if not auto-sized (bytes) */
+} stack_usage;
+
+
+/**
+	@brief Return the stack usage of the threads that ran a task.
+
+	Stack accounting is on if the environment variable @c TINYOS_STACK
+	is set at boot. Then, the stack of every new thread is filled with a
+	pattern, and when the thread exits, the part of the pattern that was
+	overwritten is the deepest stack use of the thread. This is recorded
+	for the task of the thread (the task of @c CreateThread or @c Exec),
+	and a summary for every task is printed to @c stderr at shutdown.
+
+	If @c TINYOS_STACK is "auto", once a few threads of a task have been
+	measured, new threads of the task that do not ask for a stack size get
+	a smaller stack, a few times their deepest use. This is only as safe as
+	the measured threads are typical; a thread that fills its stack turns
+	auto-sizing off for its task. Auto-sizing needs the guard pages of
+	@c TINYOS_THREAD_MEM=mmap, so that an overflow faults instead of
+	corrupting memory; otherwise, "auto" is the same as any other value.
+
+	@param task the task
+	@param usage the structure to fill
+	@returns 0 on success, or -1 if stack accounting is off, @c usage is NULL,
+	   or no thread of @c task has been measured.
+ */
+int GetStackUsage(Task task, stack_usage* usage);
+
+
+/**
+	@brief Dump the scheduler event trace.
+
+	When the environment variable @c TINYOS_TRACE names a file at boot, 
+	the scheduler records its events (context switches, wakeups, blocking,
+	timeouts and migrations) in a ring buffer per core, and dumps them to 
+	that file at shutdown. This call dumps the most recent events now, to
+	another file. The format is the Chrome trace-event JSON, which can be
+	viewed with chrome://tracing or https://ui.perfetto.dev.
+
+	@param filename the file to write (on the host)
+	@returns the number of events written, or -1 if tracing is off or the
+	  file cannot be written.
+ */
+int SchedTraceDump(const char* filename);
+
+
 
 
 /*******************************************
@@ -781,6 +1177,31 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/**
+  @brief Scheduling policies.
+
+  Real-time threads are always scheduled first, earliest deadline first.
+  All other threads are scheduled by a policy chosen at boot.
+
+  @see boot_with_policy
+  */
+typedef enum {
+  SCHED_POLICY_MLFQ,  /**< Multi-level feedback queues (the default). */
+  SCHED_POLICY_RR,    /**< Plain round-robin, in a single queue per core. */
+  SCHED_POLICY_FAIR   /**< Least virtual runtime first, with an equal CPU share per process. */
+} sched_policy;
+
+/** @brief Boot tinyos3 with a given scheduling policy.
+
+   This is the same as @c boot, except that threads that are not real-time
+   are scheduled by @c policy. @c boot uses @c SCHED_POLICY_MLFQ.
+
+   @see boot
+   */
+void boot_with_policy(unsigned int ncores, unsigned int terminals, sched_policy policy,
+  Task boot_task, int argl, void* args);
+
+
 /** @} */
 
 #endif
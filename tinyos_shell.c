@@ -15,6 +15,8 @@
 
 int Shell(size_t,const char**);
 int RunTerm(size_t,const char**);
+int Nice(size_t,const char**);
+int Quota(size_t,const char**);
 int ListPrograms(size_t,const char**);
 int Fibonacci(size_t,const char**);
 int Repeat(size_t,const char**);
@@ -42,6 +44,8 @@ COMMANDS[]  =
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
+	{"nice", Nice, 2, "nice <n> <prog> <args...>: execute '<prog> <args...>' with nice value <n> (0 to 19)."},
+	{"quota", Quota, 3, "quota <q> <p> <prog> <args...>: execute '<prog> <args...>' with at most <q> msec of CPU time per <p> msec."},
 	{"fibo", Fibonacci, 1, "Compute a fibonacci number."},
 	{"cap", Capitalize, 0, "Copy stdin to stdout, capitalizing all letters"},
 	{"lcase", LowerCase, 0, "Copy stdin to stdout, lower-casing all letters"},
@@ -136,6 +140,58 @@ int Repeat(size_t argc, const char** argv)
 }
 
 
+int Nice(size_t argc, const char** argv)
+{
+	checkargs(2);
+
+	int nice = getint(1);
+	int prog = getprog(2);
+
+	if(prog<0) {
+		printf("The program provided is not valid: %s\n", argv[2]);
+		return 2;
+	}
+
+	/* Change our own priority, so that the child inherits it. */
+	if(SetPriority(ThreadSelf(), nice)!=0) {
+		printf("The nice value provided is not valid: %d\n", nice);
+		return 1;
+	}
+
+	int status;
+	Pid_t pid = Execute(COMMANDS[prog].prog, argc-2, argv+2);
+	WaitChild(pid, &status);
+	return status;
+}
+
+
+int Quota(size_t argc, const char** argv)
+{
+	checkargs(3);
+
+	int quota = getint(1);
+	int period = getint(2);
+	int prog = getprog(3);
+
+	if(prog<0) {
+		printf("The program provided is not valid: %s\n", argv[3]);
+		return 2;
+	}
+
+	/* Limit ourselves, so that the child inherits the quota. */
+	if(quota<=0 || period<=0 || SetProcessQuota(NOPROC, quota*1000ul, period*1000ul)!=0) {
+		printf("The quota provided is not valid: %d per %d\n", quota, period);
+		return 1;
+	}
+
+	int status;
+	Pid_t pid = Execute(COMMANDS[prog].prog, argc-3, argv+3);
+	SetProcessQuota(NOPROC, 0, 0);
+	WaitChild(pid, &status);
+	return status;
+}
+
+
 int RunTerm(size_t argc, const char** argv)
 {
 	checkargs(2);
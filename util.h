@@ -452,8 +452,11 @@ static inline rlnode* rlist_pop_front(rlnode* list) { return rl_splice(list, lis
 
 	This function, applied on a non-empty list, will remove the tail of 
 	the list and return in.
+
+	When it is applied to an empty list, the function will return the
+	list itself.
 */
-static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list, list->prev); }
+static inline rlnode* rlist_pop_back(rlnode* list) { return rlist_remove(list->prev); }
 
 /**
 	@brief Return the length of a list.
@@ -583,6 +586,254 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/**
+	@defgroup treaps  Ordered trees
+	@brief  Intrusive ordered trees (treaps)
+
+	A treap is a binary search tree, which is also a heap with respect to 
+	a pseudo-random priority of each node. This keeps the tree balanced 
+	on average, so that insertion, removal and finding the minimum take 
+	expected logarithmic time.
+
+	Like @c rlnode, a @c tnode is embedded in the object it refers to, 
+	and a tree is represented by a pointer to its root node, which is 
+	@c NULL for the empty tree. Nodes are ordered by their @c key; nodes 
+	with equal keys are ordered by their address, so that every node of
+	a tree is distinct. The priority of a node is derived from its address.
+
+	@code
+	tnode* root = NULL;
+	tnode n1 = { .key = 5, .obj = mytcb };
+	root = treap_insert(root, &n1);
+	...
+	TCB* first = treap_min(root)->tcb;
+	root = treap_remove(root, &n1);
+	@endcode
+
+	The key of a node must not change while the node is in a tree.
+
+	@{
+ */
+
+/** @brief A node of an ordered tree */
+typedef struct tree_node {
+	struct tree_node* left;		/**< @brief The left subtree */
+	struct tree_node* right;	/**< @brief The right subtree */
+	uint64_t key;			/**< @brief The ordering key */
+	union {
+		void* obj;
+		TCB* tcb;
+		PCB* pcb;
+		intptr_t num;
+	};
+} tnode;
+
+
+/** @brief Return true if @c a precedes @c b in tree order. */
+static inline int treap_less(tnode* a, tnode* b)
+{
+	return a->key < b->key || (a->key == b->key && (uintptr_t)a < (uintptr_t)b);
+}
+
+/** @brief The heap priority of a node, a hash of its address. */
+static inline uint64_t treap_priority(tnode* n)
+{
+	uint64_t x = (uintptr_t)n;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/**
+	@brief Join two trees.
+
+	All nodes of @c a must precede all nodes of @c b.
+	@returns the root of the joined tree
+*/
+static inline tnode* treap_merge(tnode* a, tnode* b)
+{
+	if(a == NULL) return b;
+	if(b == NULL) return a;
+	if(treap_priority(a) > treap_priority(b)) {
+		a->right = treap_merge(a->right, b);
+		return a;
+	} else {
+		b->left = treap_merge(a, b->left);
+		return b;
+	}
+}
+
+/**
+	@brief Insert a node into a tree.
+
+	@param root the root of the tree, or @c NULL
+	@param n the node to insert, which must not be in any tree
+	@returns the new root of the tree
+*/
+static inline tnode* treap_insert(tnode* root, tnode* n)
+{
+	if(root == NULL) {
+		n->left = n->right = NULL;
+		return n;
+	}
+	if(treap_less(n, root)) {
+		root->left = treap_insert(root->left, n);
+		if(treap_priority(root->left) > treap_priority(root)) {
+			/* rotate right */
+			tnode* l = root->left;
+			root->left = l->right;
+			l->right = root;
+			root = l;
+		}
+	} else {
+		root->right = treap_insert(root->right, n);
+		if(treap_priority(root->right) > treap_priority(root)) {
+			/* rotate left */
+			tnode* r = root->right;
+			root->right = r->left;
+			r->left = root;
+			root = r;
+		}
+	}
+	return root;
+}
+
+/**
+	@brief Remove a node from a tree.
+
+	If @c n is not in the tree, the tree is not changed.
+
+	@param root the root of the tree
+	@param n the node to remove
+	@returns the new root of the tree
+*/
+static inline tnode* treap_remove(tnode* root, tnode* n)
+{
+	if(root == NULL)
+		return NULL;
+	if(root == n)
+		return treap_merge(n->left, n->right);
+	if(treap_less(n, root))
+		root->left = treap_remove(root->left, n);
+	else
+		root->right = treap_remove(root->right, n);
+	return root;
+}
+
+/**
+	@brief Return the first node of a tree in order, or @c NULL if the tree is empty.
+*/
+static inline tnode* treap_min(tnode* root)
+{
+	if(root != NULL)
+		while(root->left != NULL) root = root->left;
+	return root;
+}
+
+/**
+	@brief Return the last node of a tree in order, or @c NULL if the tree is empty.
+*/
+static inline tnode* treap_max(tnode* root)
+{
+	if(root != NULL)
+		while(root->right != NULL) root = root->right;
+	return root;
+}
+
+/* @} treaps */
+
+
+
+/**
+	@defgroup loghist  Log-linear histograms
+	@brief  Histograms of durations, with bounded relative error
+
+	A log-linear histogram counts values in buckets whose width grows
+	with the value. Values below @c 2*LOGHIST_SUB are counted exactly;
+	above that, every power of two is split in @c LOGHIST_SUB buckets of
+	equal width, so a bucket is at most 1/LOGHIST_SUB of its values wide.
+	Values of @c 2^32 or more are counted in the last bucket.
+
+	A histogram is just an array of @c LOGHIST_BUCKETS counters.
+
+	@code
+	unsigned long hist[LOGHIST_BUCKETS] = { 0 };
+	hist[loghist_bucket(latency)]++;
+	...
+	printf("median=%lu\n", loghist_percentile(hist, 50.0));
+	@endcode
+
+	@{
+ */
+
+/** @brief Log2 of the number of buckets per power of two */
+#define LOGHIST_SUB_BITS 3
+
+/** @brief The number of buckets per power of two */
+#define LOGHIST_SUB (1 << LOGHIST_SUB_BITS)
+
+/** @brief The number of buckets of a histogram */
+#define LOGHIST_BUCKETS ((33 - LOGHIST_SUB_BITS) << LOGHIST_SUB_BITS)
+
+/** @brief Return the bucket of a value */
+static inline unsigned int loghist_bucket(uint64_t v)
+{
+	if(v < 2*LOGHIST_SUB) return v;
+	if(v >> 32) return LOGHIST_BUCKETS-1;
+	int e = 63 - __builtin_clzll(v) - LOGHIST_SUB_BITS;
+	return (e << LOGHIST_SUB_BITS) + (v >> e);
+}
+
+/** @brief Return the largest value of a bucket */
+static inline uint64_t loghist_upper(unsigned int b)
+{
+	if(b < 2*LOGHIST_SUB) return b;
+	int e = (b >> LOGHIST_SUB_BITS) - 1;
+	return ((uint64_t)((b & (LOGHIST_SUB-1)) + LOGHIST_SUB + 1) << e) - 1;
+}
+
+/** @brief Return the total count of a histogram */
+static inline unsigned long loghist_count(const unsigned long* hist)
+{
+	unsigned long n = 0;
+	for(unsigned int b=0; b<LOGHIST_BUCKETS; b++) n += hist[b];
+	return n;
+}
+
+/**
+	@brief Return a percentile of a histogram.
+
+	The result is the largest value of the bucket that contains the
+	@c p-th percentile, so it may exceed the exact percentile by one
+	bucket width.
+
+	@param hist the histogram
+	@param p the percentile, between 0 and 100
+	@returns the percentile, or 0 if the histogram is empty
+ */
+static inline uint64_t loghist_percentile(const unsigned long* hist, double p)
+{
+	unsigned long n = loghist_count(hist);
+	if(n == 0) return 0;
+
+	/* The rank of the percentile, from 1 to n */
+	unsigned long rank = (unsigned long)(p * n / 100.0 + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > n) rank = n;
+
+	unsigned long sum = 0;
+	for(unsigned int b=0; b<LOGHIST_BUCKETS; b++) {
+		sum += hist[b];
+		if(sum >= rank) return loghist_upper(b);
+	}
+	return loghist_upper(LOGHIST_BUCKETS-1);
+}
+
+/* @} loghist */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
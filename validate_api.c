@@ -2,6 +2,9 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
@@ -372,11 +375,6 @@ BOOT_TEST(test_orphans_adopted_by_init,
 	Test that a timed wait on a condition variable terminates after the timeout.
  */
 
-static unsigned long tspec2msec(struct timespec t)
-{
-	return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
-}
-
 
 static int do_timeout(int argl, void* args) {
 	timeout_t t = *((timeout_t *) args);
@@ -384,18 +382,18 @@ static int do_timeout(int argl, void* args) {
 	Mutex mx = MUTEX_INIT;
 	CondVar cv = COND_INIT;
 
-	struct timespec t1, t2;
-	clock_gettime(CLOCK_REALTIME, &t1);
+	/* Use the VM's clock, which is virtual in simulation mode */
+	TimerDuration t1 = bios_precise_clock();
 
 	Mutex_Lock(&mx);
 	Cond_TimedWait(&mx, &cv, t);
 
-	clock_gettime(CLOCK_REALTIME, &t2);
+	TimerDuration t2 = bios_precise_clock();
 
-	unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+	long Dt = (t2 - t1) / 1000;
 
 	/* Allow a large, 20% error */
-	ASSERT(abs(Dt-t)*5 <= Dt);
+	ASSERT(labs(Dt - (long) t)*5 <= Dt);
 
 	return 0;
 }
@@ -2592,11 +2590,1258 @@ BARE_TEST(dummy_user_test,
 }
 
 
+static int pinned_task(int argl, void* args) 
+{
+	/* The affinity is inherited from the creator */
+	if(GetThreadAffinity(ThreadSelf()) != (1u << (cpu_cores()-1))) return 1;
+	for(int i=0; i<20; i++) {
+		if(cpu_core_id != cpu_cores()-1) return 1;
+		fibo(25);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that a thread pinned to a core runs only there, and that its affinity "
+	"is inherited by the threads it creates."
+	)
+{
+	unsigned int all = (1u << cpu_cores()) - 1;
+	unsigned int last = 1u << (cpu_cores()-1);
+
+	ASSERT(GetThreadAffinity(ThreadSelf()) == all);
+	ASSERT(GetThreadAffinity(NOTHREAD) == 0);
+	ASSERT(SetThreadAffinity(NOTHREAD, all) == -1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 0) == -1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), ~all) == -1);
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), last) == 0);
+	ASSERT(GetThreadAffinity(ThreadSelf()) == last);
+	ASSERT(cpu_core_id == cpu_cores()-1);
+
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(pinned_task, 0, NULL);
+	for(int i=0; i<4; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval) == 0);
+		ASSERT(exitval == 0);
+	}
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), all) == 0);
+	return 0;
+}
+
+
+static int compute_task(int argl, void* args)
+{
+	return fibo(25) == 0;
+}
+
+BOOT_TEST(test_sched_stats,
+	"Test that the scheduler statistics are returned, do not decrease, and count "
+	"no migrations for threads pinned to a single core."
+	)
+{
+	sched_stats s1, s2;
+	ASSERT(GetSchedStats(NULL) == -1);
+	ASSERT(GetSchedStats(&s1) == 0);
+
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(compute_task, 0, NULL);
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+
+	ASSERT(GetSchedStats(&s2) == 0);
+	ASSERT(s2.migrations >= s1.migrations);
+	ASSERT(s2.steals >= s1.steals);
+	ASSERT(s2.steals <= s2.migrations);
+	ASSERT(s2.handoffs >= s1.handoffs);
+
+	/* Threads pinned to one core, together with their creator, never migrate */
+	unsigned int all = (1u << cpu_cores()) - 1;
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1) == 0);
+	ASSERT(GetSchedStats(&s1) == 0);
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(compute_task, 0, NULL);
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+	ASSERT(GetSchedStats(&s2) == 0);
+	ASSERT(s2.migrations == s1.migrations);
+	ASSERT(s2.steals == s1.steals);
+	ASSERT(SetThreadAffinity(ThreadSelf(), all) == 0);
+	return 0;
+}
+
+
+/* Fan-out wakeups: a thread that wakes up others and goes on */
+static int fanout_core[MAX_CORES];
+static volatile int fanout_ready, fanout_woken, fanout_go, fanout_stop;
+static Mutex fanout_mx = MUTEX_INIT;
+static CondVar fanout_cv = COND_INIT;
+
+static int fanout_spinner(int argl, void* args)
+{
+	SetThreadAffinity(ThreadSelf(), 1u << argl);
+	while (!fanout_stop);
+	return 0;
+}
+
+static int fanout_waiter(int argl, void* args)
+{
+	/* Settle at core argl, but allow any core */
+	SetThreadAffinity(ThreadSelf(), 1u << argl);
+	SetThreadAffinity(ThreadSelf(), (1u << cpu_cores()) - 1);
+
+	Mutex_Lock(&fanout_mx);
+	fanout_ready++;
+	while (!fanout_go)
+		Cond_Wait(&fanout_mx, &fanout_cv);
+	Mutex_Unlock(&fanout_mx);
+
+	fanout_core[argl] = cpu_core_id;
+	__atomic_fetch_add(&fanout_woken, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+BOOT_TEST(test_wakeup_fanout_stays,
+	"Test that threads woken by a thread that does not block stay at their (busy) cores."
+	)
+{
+	uint ncores = cpu_cores();
+	if (ncores < 2)
+		return 0;
+
+	fanout_ready = fanout_woken = fanout_go = fanout_stop = 0;
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1) == 0);
+
+	/* A waiter at each other core, kept busy by a spinner */
+	Tid_t t[2 * MAX_CORES];
+	int n = 0;
+	for (uint c = 1; c < ncores; c++) {
+		t[n++] = CreateThread(fanout_spinner, c, NULL);
+		t[n++] = CreateThread(fanout_waiter, c, NULL);
+	}
+	while (fanout_ready < ncores - 1);
+
+	/* Wake them up one by one, and keep running */
+	Mutex_Lock(&fanout_mx);
+	fanout_go = 1;
+	for (uint c = 1; c < ncores; c++)
+		Cond_Signal(&fanout_cv);
+	Mutex_Unlock(&fanout_mx);
+	while (fanout_woken < ncores - 1);
+
+	fanout_stop = 1;
+	for (int i = 0; i < n; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+
+	for (uint c = 1; c < ncores; c++)
+		ASSERT(fanout_core[c] == c);
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), (1u << ncores) - 1) == 0);
+	return 0;
+}
+
+
+static volatile int rt_spin_flag;
+
+static int rt_spinner_task(int argl, void* args)
+{
+	rt_attr attr = { .runtime = 2000, .period = 10000, .deadline = 10000 };
+	if(SetThreadRealtime(ThreadSelf(), &attr) != 0) return 1;
+	while(! rt_spin_flag);
+	return 0;
+}
+
+static int rt_victim_task(int argl, void* args)
+{
+	fibo(28);
+	rt_spin_flag = 1;
+	return 0;
+}
+
+BOOT_TEST(test_realtime_threads,
+	"Test admission control of real-time threads, and that a spinning real-time "
+	"thread is throttled, so that other threads of its core make progress."
+	)
+{
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1) == 0);
+
+	rt_attr bad1 = { .runtime = 0, .period = 10000, .deadline = 10000 };
+	rt_attr bad2 = { .runtime = 5000, .period = 10000, .deadline = 4000 };
+	rt_attr bad3 = { .runtime = 5000, .period = 10000, .deadline = 20000 };
+	ASSERT(SetThreadRealtime(ThreadSelf(), &bad1) == -1);
+	ASSERT(SetThreadRealtime(ThreadSelf(), &bad2) == -1);
+	ASSERT(SetThreadRealtime(ThreadSelf(), &bad3) == -1);
+	ASSERT(SetThreadRealtime(NOTHREAD, NULL) == -1);
+
+	rt_attr a30 = { .runtime = 3000, .period = 10000, .deadline = 8000 };
+	ASSERT(SetThreadRealtime(ThreadSelf(), &a30) == 0);
+
+	rt_attr got;
+	ASSERT(GetThreadRealtime(ThreadSelf(), &got) == 0);
+	ASSERT(got.runtime == 3000 && got.period == 10000 && got.deadline == 8000);
+
+	/* Core 0 cannot take 30% + 70% */
+	rt_attr a70 = { .runtime = 7000, .period = 10000, .deadline = 10000 };
+	rt_spin_flag = 0;
+	Tid_t t = CreateThread(rt_victim_task, 0, NULL);
+	ASSERT(SetThreadRealtime(t, &a70) == -1);
+
+	/* A real-time thread cannot leave its core */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 2) == -1);
+
+	ASSERT(SetThreadRealtime(ThreadSelf(), NULL) == 0);
+	ASSERT(GetThreadRealtime(ThreadSelf(), &got) == 0);
+	ASSERT(got.runtime == 0);
+
+	/* The spinner would starve the victim, if it were not throttled */
+	Tid_t s = CreateThread(rt_spinner_task, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	int exitval;
+	ASSERT(ThreadJoin(s, &exitval) == 0);
+	ASSERT(exitval == 0);
+
+	return 0;
+}
+
+
+static volatile long policy_count[9];
+static volatile int policy_stop;
+
+/* Count until stopped; spinner 0 stops everybody when it has counted enough */
+static int policy_spinner(int argl, void* args)
+{
+	while(! policy_stop)
+		if(++policy_count[argl] >= 20000000L && argl == 0)
+			policy_stop = 1;
+	return 0;
+}
+
+static int policy_one_thread(int argl, void* args)
+{
+	return policy_spinner(0, NULL);
+}
+
+static int policy_many_threads(int argl, void* args)
+{
+	Tid_t t[8];
+	for(int i=0; i<8; i++)
+		t[i] = CreateThread(policy_spinner, i+1, NULL);
+	for(int i=0; i<8; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+static int policy_boot(int argl, void* args)
+{
+	for(int i=0; i<9; i++) policy_count[i] = 0;
+	policy_stop = 0;
+
+	Exec(policy_many_threads, 0, NULL);
+	Exec(policy_one_thread, 0, NULL);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+BARE_TEST(test_sched_policies,
+	"Test that the system runs under every scheduling policy, and that the fair\n"
+	"policy, unlike round-robin, gives a process with many threads about the share\n"
+	"of a process with one."
+	)
+{
+	sched_policy policies[] = { SCHED_POLICY_MLFQ, SCHED_POLICY_RR, SCHED_POLICY_FAIR };
+	for(int p=0; p<3; p++) {
+		boot_with_policy(1, 0, policies[p], policy_boot, 0, NULL);
+		ASSERT(policy_stop);
+
+		long many = 0;
+		for(int i=1; i<9; i++) many += policy_count[i];
+		if(policies[p] == SCHED_POLICY_FAIR)
+			ASSERT_MSG(many < 3*policy_count[0], "many=%ld one=%ld\n", many, policy_count[0]);
+		/* Round-robin shares by thread */
+		if(policies[p] == SCHED_POLICY_RR)
+			ASSERT_MSG(many > 3*policy_count[0], "many=%ld one=%ld\n", many, policy_count[0]);
+	}
+}
+
+
+/*
+  Spinners 1 and 2 run on core 0, and the rest on core 1. Spinner 0 shares
+  core 1 with spinners 3 and 4.
+*/
+static int fair_pinned_spinner(int argl, void* args)
+{
+	SetThreadAffinity(ThreadSelf(), (argl == 1 || argl == 2) ? 1 : 2);
+	return policy_spinner(argl, NULL);
+}
+
+static int fair_four_threads(int argl, void* args)
+{
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(fair_pinned_spinner, i+1, NULL);
+	for(int i=0; i<4; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+static int fair_one_thread(int argl, void* args)
+{
+	return fair_pinned_spinner(0, NULL);
+}
+
+static int fair_boot(int argl, void* args)
+{
+	for(int i=0; i<9; i++) policy_count[i] = 0;
+	policy_stop = 0;
+
+	Exec(fair_four_threads, 0, NULL);
+	Exec(fair_one_thread, 0, NULL);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+BARE_TEST(test_fair_processes,
+	"Test that the fair policy gives about equal CPU time to a process of four\n"
+	"threads and a process of one, when the threads of the first spread over\n"
+	"two cores."
+	)
+{
+	boot_with_policy(2, 0, SCHED_POLICY_FAIR, fair_boot, 0, NULL);
+	ASSERT(policy_stop);
+
+	long many = 0;
+	for(int i=1; i<=4; i++) many += policy_count[i];
+	ASSERT_MSG(2*many < 3*policy_count[0] && 2*policy_count[0] < 3*many,
+		"many=%ld one=%ld\n", many, policy_count[0]);
+}
+
+
+static int usage_task(int argl, void* args)
+{
+	return fibo(27) == 0;
+}
+
+BOOT_TEST(test_cpu_usage,
+	"Test that the CPU usage of threads and processes is accounted."
+	)
+{
+	cpu_usage u, self, children;
+	ASSERT(GetThreadUsage(ThreadSelf(), NULL) == -1);
+	ASSERT(GetThreadUsage(NOTHREAD, &u) == -1);
+	ASSERT(GetProcessUsage(MAX_PROC, &self, NULL) == -1);
+	ASSERT(GetProcessUsage(GetPid(), NULL, NULL) == 0);
+
+	fibo(27);
+	ASSERT(GetThreadUsage(ThreadSelf(), &u) == 0);
+	ASSERT(u.cpu_time > 0);
+
+	/* Joining a busy thread blocks */
+	Tid_t t = CreateThread(usage_task, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	ASSERT(GetThreadUsage(ThreadSelf(), &u) == 0);
+	ASSERT(u.voluntary >= 1);
+
+	/* The exited thread is counted in the process */
+	ASSERT(GetProcessUsage(GetPid(), &self, &children) == 0);
+	ASSERT(self.cpu_time > u.cpu_time);
+	ASSERT(children.cpu_time == 0);
+
+	/* A reaped child is counted in the children */
+	Pid_t pid = Exec(usage_task, 0, NULL);
+	ASSERT(WaitChild(pid, NULL) == pid);
+	ASSERT(GetProcessUsage(GetPid(), NULL, &children) == 0);
+	ASSERT(children.cpu_time > 0);
+	return 0;
+}
+
+
+static int nice_task(int argl, void* args)
+{
+	return GetPriority(ThreadSelf()) != argl;
+}
+
+BOOT_TEST(test_thread_priority,
+	"Test that the nice value of a thread can be set, and that it is inherited\n"
+	"by new threads and processes."
+	)
+{
+	Tid_t self = ThreadSelf();
+	ASSERT(GetPriority(self) == 0);
+	ASSERT(GetPriority(NOTHREAD) == -1);
+	ASSERT(SetPriority(self, -1) == -1);
+	ASSERT(SetPriority(self, MAX_NICE+1) == -1);
+	ASSERT(SetPriority(NOTHREAD, 1) == -1);
+
+	ASSERT(SetPriority(self, 10) == 0);
+	ASSERT(GetPriority(self) == 10);
+
+	/* A new thread inherits the nice value */
+	int exitval;
+	Tid_t t = CreateThread(nice_task, 10, NULL);
+	ASSERT(ThreadJoin(t, &exitval) == 0);
+	ASSERT(exitval == 0);
+
+	/* So does the main thread of a child process */
+	Pid_t pid = Exec(nice_task, 10, NULL);
+	ASSERT(WaitChild(pid, &exitval) == pid);
+	ASSERT(exitval == 0);
+
+	/* The nice value of another thread can be changed */
+	t = CreateThread(compute_task, 0, NULL);
+	ASSERT(SetPriority(t, MAX_NICE) == 0 || GetPriority(t) == -1);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+
+	ASSERT(SetPriority(self, 0) == 0);
+	ASSERT(GetPriority(self) == 0);
+	return 0;
+}
+
+
+/* Write argl bytes to the pipe whose write end is passed, at the lowest priority */
+static int lowprio_writer(int argl, void* args)
+{
+	Fid_t w = *(Fid_t*)args;
+	SetPriority(ThreadSelf(), MAX_NICE);
+	char buf[64];
+	memset(buf, 'x', sizeof(buf));
+	for (int n = 0; n < argl; ) {
+		int r = Write(w, buf, (argl - n < sizeof(buf)) ? argl - n : sizeof(buf));
+		if (r <= 0) return 1;
+		n += r;
+	}
+	return 0;
+}
+
+/* Shared state of the mutex part of test_priority_inheritance */
+static Mutex pi_mx = MUTEX_INIT;
+static Mutex pi_cmx = MUTEX_INIT;
+static CondVar pi_cv = COND_INIT;
+static volatile int pi_locked, pi_go, pi_stop, pi_spun;
+
+/* Lock pi_mx at the lowest priority, and hold it for a while once told to */
+static int pi_holder(int argl, void* args)
+{
+	SetPriority(ThreadSelf(), MAX_NICE);
+	Mutex_Lock(&pi_mx);
+	Mutex_Lock(&pi_cmx);
+	pi_locked = 1;
+	Cond_Signal(&pi_cv);
+	Mutex_Unlock(&pi_cmx);
+
+	while (!pi_go);
+	int r = fibo(25) == 0;
+	Mutex_Unlock(&pi_mx);
+	return r;
+}
+
+/* Spin at a middle priority, until stopped */
+static int pi_spinner(int argl, void* args)
+{
+	pi_spun = 1;
+	while (!pi_stop);
+	return 0;
+}
+
+BOOT_TEST(test_priority_inheritance,
+	"Test that a low-priority thread and a high-priority thread that contend\n"
+	"for the kernel on a pipe make progress among mid-priority threads, and that\n"
+	"the low-priority holder of a mutex runs before mid-priority threads that\n"
+	"never block, while a high-priority thread waits for the mutex."
+	)
+{
+	const int N = 20000;
+	pipe_t p;
+	ASSERT(Pipe(&p) == 0);
+
+	Tid_t writer = CreateThread(lowprio_writer, N, &p.write);
+
+	Tid_t busy[4];
+	for (int i = 0; i < 4; i++) {
+		busy[i] = CreateThread(compute_task, 0, NULL);
+		SetPriority(busy[i], MAX_NICE/2);
+	}
+
+	char buf[64];
+	int n = 0, r;
+	while (n < N && (r = Read(p.read, buf, (N - n < sizeof(buf)) ? N - n : sizeof(buf))) > 0)
+		n += r;
+	ASSERT(n == N);
+
+	int exitval;
+	ASSERT(ThreadJoin(writer, &exitval) == 0);
+	ASSERT(exitval == 0);
+	for (int i = 0; i < 4; i++)
+		ASSERT(ThreadJoin(busy[i], NULL) == 0);
+
+	/* On one core, the spinners would starve the holder, unless it
+	   inherits our priority while we are blocked */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1) == 0);
+	pi_locked = pi_go = pi_stop = pi_spun = 0;
+	Tid_t holder = CreateThread(pi_holder, 0, NULL);
+	Mutex_Lock(&pi_cmx);
+	while (!pi_locked)
+		Cond_Wait(&pi_cmx, &pi_cv);
+	Mutex_Unlock(&pi_cmx);
+
+	for (int i = 0; i < 4; i++) {
+		busy[i] = CreateThread(pi_spinner, 0, NULL);
+		SetPriority(busy[i], MAX_NICE/2);
+	}
+	pi_go = 1;
+	Mutex_Lock(&pi_mx);
+	int spun = pi_spun;
+	Mutex_Unlock(&pi_mx);
+
+	pi_stop = 1;
+	ASSERT(ThreadJoin(holder, &exitval) == 0);
+	ASSERT(exitval == 0);
+	for (int i = 0; i < 4; i++)
+		ASSERT(ThreadJoin(busy[i], NULL) == 0);
+	ASSERT(SetThreadAffinity(ThreadSelf(), (1u << cpu_cores()) - 1) == 0);
+	ASSERT(spun == 0);
+	return 0;
+}
+
+
+/* Shared state of test_nested_priority_inheritance */
+static Mutex pi_inner = MUTEX_INIT;
+static volatile int pi_waiting;
+
+/* Hold pi_mx and pi_inner at the lowest priority, and release them in turn */
+static int pi_nested_holder(int argl, void* args)
+{
+	SetPriority(ThreadSelf(), MAX_NICE);
+	Mutex_Lock(&pi_mx);
+	Mutex_Lock(&pi_inner);
+	Mutex_Lock(&pi_cmx);
+	pi_locked = 1;
+	Cond_Signal(&pi_cv);
+	Mutex_Unlock(&pi_cmx);
+
+	while (!pi_go);
+	int r = fibo(25) == 0;
+	Mutex_Unlock(&pi_inner);
+	r |= fibo(30) == 0;
+	Mutex_Unlock(&pi_mx);
+	return r;
+}
+
+/* Wait for pi_mx, and return whether the spinners ran meanwhile */
+static int pi_outer_waiter(int argl, void* args)
+{
+	Mutex_Lock(&pi_cmx);
+	pi_waiting = 1;
+	Cond_Signal(&pi_cv);
+	Mutex_Unlock(&pi_cmx);
+
+	Mutex_Lock(&pi_mx);
+	int spun = pi_spun;
+	Mutex_Unlock(&pi_mx);
+	return spun;
+}
+
+BOOT_TEST(test_nested_priority_inheritance,
+	"Test that the low-priority holder of two nested mutexes, with a thread\n"
+	"blocked on each, keeps its inherited priority after it unlocks the inner\n"
+	"one, and runs before mid-priority threads until it unlocks the outer one."
+	)
+{
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1) == 0);
+	pi_locked = pi_waiting = pi_go = pi_stop = pi_spun = 0;
+	Tid_t holder = CreateThread(pi_nested_holder, 0, NULL);
+	Mutex_Lock(&pi_cmx);
+	while (!pi_locked)
+		Cond_Wait(&pi_cmx, &pi_cv);
+	Mutex_Unlock(&pi_cmx);
+
+	/* This one blocks on the outer mutex */
+	Tid_t waiter = CreateThread(pi_outer_waiter, 0, NULL);
+	Mutex_Lock(&pi_cmx);
+	while (!pi_waiting)
+		Cond_Wait(&pi_cmx, &pi_cv);
+	Mutex_Unlock(&pi_cmx);
+
+	Tid_t busy[4];
+	for (int i = 0; i < 4; i++) {
+		busy[i] = CreateThread(pi_spinner, 0, NULL);
+		SetPriority(busy[i], MAX_NICE/2);
+	}
+
+	/* We block on the inner mutex, and then wait for the outer one to pass */
+	pi_go = 1;
+	Mutex_Lock(&pi_inner);
+	Mutex_Unlock(&pi_inner);
+	int spun;
+	ASSERT(ThreadJoin(waiter, &spun) == 0);
+
+	pi_stop = 1;
+	int exitval;
+	ASSERT(ThreadJoin(holder, &exitval) == 0);
+	ASSERT(exitval == 0);
+	for (int i = 0; i < 4; i++)
+		ASSERT(ThreadJoin(busy[i], NULL) == 0);
+	ASSERT(SetThreadAffinity(ThreadSelf(), (1u << cpu_cores()) - 1) == 0);
+	ASSERT(spun == 0);
+	return 0;
+}
+
+
+/* Shared state of test_cond_timedwait_busy */
+static volatile int busy_stop;
+
+static int busy_spinner(int argl, void* args)
+{
+	while (!busy_stop);
+	return 0;
+}
+
+BOOT_TEST(test_cond_timedwait_busy,
+	"Test that a short Cond_TimedWait times out in time, while a thread that\n"
+	"never blocks keeps a core busy with long time-slices."
+	)
+{
+	busy_stop = 0;
+	Tid_t spinner = CreateThread(busy_spinner, 0, NULL);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	long worst = 0;
+	for (int i = 0; i < 20; i++) {
+		Mutex_Lock(&mx);
+		TimerDuration t1 = bios_precise_clock();
+		ASSERT(Cond_TimedWait(&mx, &cv, 5) == 0);
+		TimerDuration t2 = bios_precise_clock();
+		Mutex_Unlock(&mx);
+		long late = (long)(t2 - t1) - 5000;
+		if (late > worst)
+			worst = late;
+	}
+
+	busy_stop = 1;
+	ASSERT(ThreadJoin(spinner, NULL) == 0);
+
+	/* Far less than the longest time-slice (80 msec) */
+	ASSERT(worst < 25000);
+	return 0;
+}
+
+
+/* Shared state of test_broadcast_many */
+static Mutex bcast_mx = MUTEX_INIT;
+static CondVar bcast_cv = COND_INIT;
+static int bcast_go, bcast_waiting, bcast_woken;
+
+static int bcast_waiter(int argl, void* args)
+{
+	Mutex_Lock(&bcast_mx);
+	bcast_waiting++;
+	while (!bcast_go)
+		Cond_Wait(&bcast_mx, &bcast_cv);
+	bcast_woken++;
+	Mutex_Unlock(&bcast_mx);
+	return 0;
+}
+
+BOOT_TEST(test_broadcast_many,
+	"Test that a broadcast wakes up more waiters than a single batch."
+	)
+{
+	const int N = 150;
+	Tid_t t[N];
+	bcast_go = bcast_waiting = bcast_woken = 0;
+	for (int i = 0; i < N; i++)
+		t[i] = CreateThread(bcast_waiter, 0, NULL);
+
+	/* Wait until all have blocked */
+	Mutex_Lock(&bcast_mx);
+	while (bcast_waiting < N)
+		Cond_TimedWait(&bcast_mx, &bcast_cv, 1);
+	bcast_go = 1;
+	Cond_Broadcast(&bcast_cv);
+	Mutex_Unlock(&bcast_mx);
+
+	for (int i = 0; i < N; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+	ASSERT(bcast_woken == N);
+	return 0;
+}
+
+
+/* Threads of a parallel-for loop, synchronizing at a barrier in each round */
+static barrier gang_barrier;
+static int gang_worker(int argl, void* args)
+{
+	for (int round = 0; round < 20; round++) {
+		fibo(15);
+		BarrierSync(&gang_barrier, argl);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_gang_mode,
+	"Test that a process in gang mode runs its threads to completion, while\n"
+	"another process competes for the cores.",
+	.minimum_cores = 2
+	)
+{
+	ASSERT(SetGangMode(1) == 0);
+	ASSERT(SetGangMode(1) == 1);
+
+	Pid_t busy = Exec(compute_task, 0, NULL);
+
+	sched_stats s1, s2;
+	ASSERT(GetSchedStats(&s1) == 0);
+
+	const int N = 4;
+	Tid_t t[N];
+	gang_barrier = BARRIER_INIT;
+	for (int i = 0; i < N; i++)
+		t[i] = CreateThread(gang_worker, N, NULL);
+	for (int i = 0; i < N; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+
+	ASSERT(GetSchedStats(&s2) == 0);
+	ASSERT(s2.gang_dispatches > s1.gang_dispatches);
+
+	ASSERT(WaitChild(busy, NULL) == busy);
+	ASSERT(SetGangMode(0) == 1);
+	ASSERT(SetGangMode(0) == 0);
+	return 0;
+}
+
+
+/* Spin for argl msec of wall-clock time */
+static int wallclock_spinner(int argl, void* args)
+{
+	struct timespec t0, t;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t);
+	} while ((t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000 < argl);
+	return 0;
+}
+
+BOOT_TEST(test_process_quota,
+	"Test that a process with a CPU quota does not use more than its quota."
+	)
+{
+	unsigned long quota, period;
+	ASSERT(GetProcessQuota(NOPROC, &quota, &period) == 0);
+	ASSERT(quota == 0);
+	ASSERT(SetProcessQuota(MAX_PROC, 1000, 1000) == -1);
+	ASSERT(SetProcessQuota(NOPROC, 1000, 0) == -1);
+
+	/* The child inherits our quota */
+	ASSERT(SetProcessQuota(NOPROC, 20000, 100000) == 0);
+	Pid_t pid = Exec(wallclock_spinner, 400, NULL);
+	ASSERT(GetProcessQuota(pid, &quota, &period) == 0);
+	ASSERT(quota == 20000 && period == 100000);
+	ASSERT(SetProcessQuota(NOPROC, 0, 0) == 0);
+
+	ASSERT(WaitChild(pid, NULL) == pid);
+	cpu_usage children;
+	ASSERT(GetProcessUsage(GetPid(), NULL, &children) == 0);
+	ASSERT(children.cpu_time > 0);
+	ASSERT(children.cpu_time < 200000);
+	return 0;
+}
+
+
+/* Spin for argl msec, and return the number of times we were preempted */
+static int preempted_spinner(int argl, void* args)
+{
+	wallclock_spinner(argl, NULL);
+	cpu_usage u;
+	GetThreadUsage(ThreadSelf(), &u);
+	return u.involuntary;
+}
+
+BOOT_TEST(test_mlfq_quantum,
+	"Test that CPU-bound threads sharing a core get long time-slices."
+	)
+{
+	Tid_t t[2];
+	for (int i = 0; i < 2; i++) {
+		t[i] = CreateThread(preempted_spinner, 600, NULL);
+		ASSERT(SetThreadAffinity(t[i], 1) == 0);
+	}
+
+	/* With QUANTUM time-slices, each would be preempted about 30 times */
+	for (int i = 0; i < 2; i++) {
+		int preempted;
+		ASSERT(ThreadJoin(t[i], &preempted) == 0);
+		ASSERT(preempted < 20);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_latency,
+	"Test that the wakeup latency of threads is measured, in total and by cause."
+	)
+{
+	sched_latency l0, l1, u0, u1, p0, p1;
+	ASSERT(GetSchedLatency(-1, -1, NULL) == -1);
+	ASSERT(GetSchedLatency(-2, -1, &l0) == -1);
+	ASSERT(GetSchedLatency(cpu_cores(), -1, &l0) == -1);
+	ASSERT(GetSchedLatency(-1, -2, &l0) == -1);
+	ASSERT(GetSchedLatency(-1, SCHED_CAUSE_PREEMPT + 1, &l0) == -1);
+	ASSERT(GetSchedLatency(-1, -1, &l0) == 0);
+	ASSERT(GetSchedLatency(-1, SCHED_CAUSE_USER, &u0) == 0);
+	ASSERT(GetSchedLatency(-1, SCHED_CAUSE_PIPE, &p0) == 0);
+
+	/* Every timeout makes this thread ready */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for (int i = 0; i < 20; i++)
+		Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+
+	ASSERT(GetSchedLatency(-1, -1, &l1) == 0);
+	ASSERT(l1.count >= l0.count + 20);
+	ASSERT(l1.p50 <= l1.p99 && l1.p99 <= l1.p999);
+	ASSERT(l1.p50 < 1000000);
+
+	/* The timed waits are counted under their own cause only */
+	ASSERT(GetSchedLatency(-1, SCHED_CAUSE_USER, &u1) == 0);
+	ASSERT(GetSchedLatency(-1, SCHED_CAUSE_PIPE, &p1) == 0);
+	ASSERT(u1.count >= u0.count + 20);
+	ASSERT(u1.count <= l1.count);
+	ASSERT(p1.count == p0.count);
+
+	unsigned long count = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		sched_latency lc;
+		ASSERT(GetSchedLatency(c, -1, &lc) == 0);
+		count += lc.count;
+	}
+	ASSERT(count >= l1.count);
+	return 0;
+}
+
+
+/* Dump the trace while running, and return the number of events */
+static int trace_boot(int argl, void* args)
+{
+	Tid_t t = CreateThread(usage_task, 0, NULL);
+	ThreadJoin(t, NULL);
+	sleep_thread(1);
+	return SchedTraceDump((const char*) args);
+}
+
+/* Return 1 if the file exists and contains the string */
+static int file_contains(const char* filename, const char* str)
+{
+	FILE* f = fopen(filename, "r");
+	if (f == NULL) return 0;
+	static char buf[1 << 20];
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	return strstr(buf, str) != NULL;
+}
+
+static int trace_dumped;
+static int trace_main(int argl, void* args)
+{
+	Pid_t pid = Exec(trace_boot, argl, args);
+	WaitChild(pid, &trace_dumped);
+	return 0;
+}
+
+BARE_TEST(test_sched_trace,
+	"Test that the scheduler trace is dumped in Chrome trace-event JSON, on\n"
+	"demand and at shutdown."
+	)
+{
+	char final[] = "/tmp/tinyos_trace_XXXXXX";
+	char now[] = "/tmp/tinyos_now_XXXXXX";
+	close(mkstemp(final));
+	close(mkstemp(now));
+
+	/* Tracing is off by default */
+	unsetenv("TINYOS_TRACE");
+	boot(2, 0, trace_main, sizeof(now), now);
+	ASSERT(trace_dumped == -1);
+
+	setenv("TINYOS_TRACE", final, 1);
+	boot(2, 0, trace_main, sizeof(now), now);
+	unsetenv("TINYOS_TRACE");
+	ASSERT(trace_dumped > 0);
+
+	ASSERT(file_contains(now, "{\"traceEvents\":["));
+	ASSERT(file_contains(now, "\"name\":\"switch\""));
+	ASSERT(file_contains(now, "\"name\":\"wakeup\""));
+	ASSERT(file_contains(final, "\"name\":\"timeout\""));
+	ASSERT(file_contains(final, "\"ph\":\"X\""));
+	unlink(final);
+	unlink(now);
+}
+
+
+static int nop_task(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(test_thread_reuse,
+	"Test that new threads reuse the memory of exited threads."
+	)
+{
+	sched_stats s1, s2;
+	ASSERT(GetSchedStats(&s1) == 0);
+
+	for (int i = 0; i < 200; i++) {
+		int ret;
+		Tid_t t = CreateThread(nop_task, i, NULL);
+		ASSERT(ThreadJoin(t, &ret) == 0);
+		ASSERT(ret == i);
+	}
+
+	ASSERT(GetSchedStats(&s2) == 0);
+	ASSERT(s2.threads_reused >= s1.threads_reused + 100);
+	return 0;
+}
+
+
+/* Many threads wait on a condition */
+static Mutex many_mx = MUTEX_INIT;
+static CondVar many_cv = COND_INIT;
+static int many_go;
+
+static int many_waiter(int argl, void* args)
+{
+	Mutex_Lock(&many_mx);
+	while (!many_go)
+		Cond_Wait(&many_mx, &many_cv);
+	Mutex_Unlock(&many_mx);
+	return argl;
+}
+
+#define MANY_THREADS 1000
+static int many_threads_main(int argl, void* args)
+{
+	static Tid_t t[MANY_THREADS];
+	many_go = 0;
+	for (int i = 0; i < MANY_THREADS; i++) {
+		t[i] = CreateThread(many_waiter, i, NULL);
+		ASSERT(t[i] != NOTHREAD);
+	}
+
+	Mutex_Lock(&many_mx);
+	many_go = 1;
+	Cond_Broadcast(&many_cv);
+	Mutex_Unlock(&many_mx);
+
+	for (int i = 0; i < MANY_THREADS; i++) {
+		int ret;
+		ASSERT(ThreadJoin(t[i], &ret) == 0);
+		ASSERT(ret == i);
+	}
+	return 0;
+}
+
+/* Recurse until the stack overflows */
+static int overflow(int n)
+{
+	volatile char frame[1024];
+	frame[0] = n;
+	if (n < 1000000)
+		frame[1] = overflow(n + 1);
+	return frame[0] + frame[1];
+}
+
+static int overflow_main(int argl, void* args)
+{
+	return overflow(0);
+}
+
+/* Touch 64 kbytes of stack, and leave their address in stack_touched */
+static char* stack_touched;
+static int touch_stack(int argl, void* args)
+{
+	volatile char buf[64*1024];
+	memset((char*)buf, 1, sizeof(buf));
+	stack_touched = (char*) buf;
+	return buf[argl];
+}
+
+/* Check whether the stack pages that a finished thread touched are resident */
+static int stack_resident;
+static int touched_main(int argl, void* args)
+{
+	/* On one core, the exited thread is released before we resume */
+	ASSERT(ThreadJoin(CreateThread(touch_stack, 0, NULL), NULL) == 0);
+
+	long page = sysconf(_SC_PAGESIZE);
+	char* addr = (char*)((uintptr_t)(stack_touched + 32*1024) & ~(uintptr_t)(page - 1));
+	unsigned char vec;
+	ASSERT(mincore(addr, page, &vec) == 0);
+	stack_resident = vec & 1;
+	return 0;
+}
+
+BARE_TEST(test_thread_mmap,
+	"Test that thread stacks can be allocated by mmap, with a guard page, and\n"
+	"that the stacks of the blocks kept for reuse are not resident."
+	)
+{
+	setenv("TINYOS_THREAD_MEM", "mmap", 1);
+	boot(2, 0, many_threads_main, 0, NULL);
+
+	/* A stack overflow is a segmentation fault */
+	pid_t pid = fork();
+	ASSERT(pid != -1);
+	if (pid == 0) {
+		boot(1, 0, overflow_main, 0, NULL);
+		_exit(0);
+	}
+	unsetenv("TINYOS_THREAD_MEM");
+
+	int status;
+	ASSERT(waitpid(pid, &status, 0) == pid);
+	ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+	/* The stack of a block kept for reuse is given back to the host */
+	setenv("TINYOS_THREAD_MEM", "mmap", 1);
+	stack_resident = -1;
+	boot(1, 0, touched_main, 0, NULL);
+	unsetenv("TINYOS_THREAD_MEM");
+	ASSERT(stack_resident == 0);
+
+	/* Back to malloc */
+	boot(2, 0, many_threads_main, 0, NULL);
+}
+
+
+/* Use about 1 kbyte of stack per level */
+static int deep_recursion(int n)
+{
+	volatile char frame[1024];
+	frame[0] = n;
+	if (n > 0)
+		frame[1] = deep_recursion(n - 1);
+	return frame[0] + frame[1];
+}
+
+static int deep_task(int argl, void* args)
+{
+	deep_recursion(argl);
+	return argl;
+}
+
+static int stack_size_main(int argl, void* args)
+{
+	thread_attr attr;
+
+	/* Bad attributes */
+	ASSERT(CreateThreadEx(NULL, 0, NULL, NULL) == NOTHREAD);
+	attr.stack_size = THREAD_STACK_MIN - 1;
+	ASSERT(CreateThreadEx(nop_task, 0, NULL, &attr) == NOTHREAD);
+	attr.stack_size = THREAD_STACK_MAX + 1;
+	ASSERT(CreateThreadEx(nop_task, 0, NULL, &attr) == NOTHREAD);
+
+	/* A deep recursion, well beyond the default stack size */
+	int ret;
+	attr.stack_size = 1024 * 1024;
+	Tid_t t = CreateThreadEx(deep_task, 700, NULL, &attr);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &ret) == 0);
+	ASSERT(ret == 700);
+
+	/* Many threads with small stacks */
+	static Tid_t small[200];
+	attr.stack_size = THREAD_STACK_MIN;
+	for (int i = 0; i < 200; i++) {
+		small[i] = CreateThreadEx(deep_task, 4, NULL, &attr);
+		ASSERT(small[i] != NOTHREAD);
+	}
+	for (int i = 0; i < 200; i++) {
+		ASSERT(ThreadJoin(small[i], &ret) == 0);
+		ASSERT(ret == 4);
+	}
+
+	/* NULL attributes are the defaults */
+	t = CreateThreadEx(deep_task, 64, NULL, NULL);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &ret) == 0);
+	ASSERT(ret == 64);
+	return 0;
+}
+
+BARE_TEST(test_thread_stack_size,
+	"Test that CreateThreadEx creates threads with the given stack size, "
+	"with both kinds of thread memory."
+	)
+{
+	boot(2, 0, stack_size_main, 0, NULL);
+	setenv("TINYOS_THREAD_MEM", "mmap", 1);
+	boot(2, 0, stack_size_main, 0, NULL);
+	unsetenv("TINYOS_THREAD_MEM");
+}
+
+
+static int stack_usage_main(int argl, void* args)
+{
+	stack_usage usage;
+
+	/* Accounting is off */
+	if (argl == 0) {
+		ASSERT(GetStackUsage(deep_task, &usage) == -1);
+		return 0;
+	}
+
+	ASSERT(GetStackUsage(deep_task, NULL) == -1);
+	ASSERT(GetStackUsage(nop_task, &usage) == -1);
+
+	/* Threads of deep_task, each using about 8 kbytes; a few of them are
+	   auto-sized, if the thread memory has guard pages (argl == 2) */
+	for (int i = 0; i < 12; i++) {
+		int ret;
+		Tid_t t = CreateThread(deep_task, 8, NULL);
+		ASSERT(t != NOTHREAD);
+		ASSERT(ThreadJoin(t, &ret) == 0);
+		ASSERT(ret == 8);
+
+		ASSERT(GetStackUsage(deep_task, &usage) == 0);
+		ASSERT(usage.threads == i + 1);
+		ASSERT(usage.max_used >= 8 * 1024);
+		ASSERT(usage.max_used < 128 * 1024);
+		if (i == 0 || argl == 1)
+			ASSERT(usage.auto_size == 0);
+	}
+	if (argl == 2) {
+		ASSERT(usage.auto_size >= 2 * usage.max_used);
+		ASSERT(usage.auto_size < 128 * 1024);
+	}
+	return 0;
+}
+
+BARE_TEST(test_stack_usage,
+	"Test that the stack usage of tasks is measured, and used to auto-size stacks\n"
+	"only when thread memory has guard pages."
+	)
+{
+	/* Hide the report printed at shutdown */
+	int err = dup(2);
+	int null = open("/dev/null", O_WRONLY);
+	ASSERT(err != -1 && null != -1);
+	dup2(null, 2);
+
+	setenv("TINYOS_STACK", "auto", 1);
+	boot(1, 0, stack_usage_main, 1, NULL);
+	setenv("TINYOS_THREAD_MEM", "mmap", 1);
+	boot(1, 0, stack_usage_main, 2, NULL);
+	unsetenv("TINYOS_THREAD_MEM");
+	unsetenv("TINYOS_STACK");
+
+	dup2(err, 2);
+	close(err);
+	close(null);
+	boot(1, 0, stack_usage_main, 0, NULL);
+}
+
+
+/* The log of a simulated run */
+static Mutex sim_log_mx = MUTEX_INIT;
+static unsigned long sim_log[600];
+static int sim_log_len;
+
+static int sim_worker(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	for (int i = 0; i < 100; i++) {
+		Mutex_Lock(&sim_log_mx);
+		sim_log[sim_log_len++] = argl * 1000000ul + bios_precise_clock() % 1000000ul;
+		Mutex_Unlock(&sim_log_mx);
+
+		if (i % 10 == argl) {
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 1);
+			Mutex_Unlock(&mx);
+		} else
+			for (int j = 0; j < 50; j++) bios_clock();
+	}
+	return 0;
+}
+
+/* Run some workers, then sleep for a long (virtual) time */
+static int sim_main(int argl, void* args)
+{
+	Tid_t t[5];
+	for (int i = 0; i < 5; i++)
+		t[i] = CreateThread(sim_worker, i, NULL);
+	for (int i = 0; i < 5; i++)
+		ThreadJoin(t[i], NULL);
+	sleep_thread(10);
+	return 0;
+}
+
+/* Boot a simulation, and return a hash of its log */
+static unsigned long sim_run(const char* seed)
+{
+	setenv("TINYOS_SIM_SEED", seed, 1);
+	sim_log_len = 0;
+	boot(4, 0, sim_main, 0, NULL);
+	unsetenv("TINYOS_SIM_SEED");
+
+	ASSERT(sim_log_len == 500);
+	unsigned long h = 14695981039346656037ul;
+	for (int i = 0; i < sim_log_len; i++)
+		h = (h ^ sim_log[i]) * 1099511628211ul;
+	return h;
+}
+
+BARE_TEST(test_sim_deterministic,
+	"Test that a simulation with the same seed interleaves the cores the same way,\n"
+	"on a virtual clock."
+	)
+{
+	time_t start = time(NULL);
+	unsigned long h1 = sim_run("12345");
+	unsigned long h2 = sim_run("12345");
+	unsigned long h3 = sim_run("54321");
+	ASSERT(h1 == h2);
+	ASSERT(h1 != h3);
+
+	/* The 10 second sleeps took no time */
+	ASSERT(time(NULL) - start < 20);
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_thread_affinity,
+	&test_sched_stats,
+	&test_wakeup_fanout_stays,
+	&test_realtime_threads,
+	&test_sched_policies,
+	&test_fair_processes,
+	&test_cpu_usage,
+	&test_thread_priority,
+	&test_priority_inheritance,
+	&test_nested_priority_inheritance,
+	&test_cond_timedwait_busy,
+	&test_broadcast_many,
+	&test_gang_mode,
+	&test_process_quota,
+	&test_mlfq_quantum,
+	&test_sched_trace,
+	&test_sched_latency,
+	&test_sim_deterministic,
+	&test_thread_reuse,
+	&test_thread_mmap,
+	&test_thread_stack_size,
+	&test_stack_usage,
 	NULL
 };
 